@@ -12,7 +12,9 @@ const MS_TPM_20_REF_SRC_PATH: &str = "./ms-tpm-20-ref/TPMCmd/";
 fn main() -> Result<(), Box<dyn std::error::Error>> {
     // `RunCommand.c` contains setjmp/longjmp code, and must be compiled in
     // separately
-    cc::Build::new()
+    let mut builder = cc::Build::new();
+    configure_lto(&mut builder);
+    builder
         .file("./src/plat/RunCommand.c")
         .compile("run_command");
 
@@ -75,8 +77,14 @@ fn compile_ms_tpm_20_ref() -> Result<(), Box<dyn std::error::Error>> {
     };
 
     let mut builder = cc::Build::new();
+    configure_lto(&mut builder);
     builder.include(&ossl_include);
 
+    // build profile (see `Implementation.h`)
+    if std::env::var_os("CARGO_FEATURE_VTPM_MINIMAL").is_some() {
+        builder.define("TPM_PROFILE_VTPM_MINIMAL", "1");
+    }
+
     let includes = [
         "./overrides/include".into(),
         "./overrides/include/ossl".into(),
@@ -146,6 +154,36 @@ fn compile_ms_tpm_20_ref() -> Result<(), Box<dyn std::error::Error>> {
     Ok(())
 }
 
+/// Configure cross-language LTO (and optionally, PGO) when the
+/// `cross-lang-lto` feature is enabled. See `README.md` for details.
+fn configure_lto(builder: &mut cc::Build) {
+    if std::env::var_os("CARGO_FEATURE_CROSS_LANG_LTO").is_none() {
+        return;
+    }
+
+    // the C code has to be compiled to LLVM bitcode, and archived using a tool
+    // that understands it. Both can still be overridden via the usual cc env
+    // vars, e.g: to select a specific toolchain version matching rustc's LLVM.
+    if env("CC").is_none() {
+        builder.compiler("clang");
+    }
+    if env("AR").is_none() {
+        builder.archiver("llvm-ar");
+    }
+
+    builder.flag("-flto=thin");
+
+    if let Some(dir) = env("TPM_PGO_PROFILE_GENERATE") {
+        builder.flag(&format!("-fprofile-generate={}", dir.to_string_lossy()));
+    }
+
+    if let Some(profile) = env("TPM_PGO_PROFILE_USE") {
+        let profile = profile.to_string_lossy();
+        builder.flag(&format!("-fprofile-use={}", profile));
+        println!("cargo:rerun-if-changed={}", profile);
+    }
+}
+
 fn add_deps(
     builder: &mut cc::Build,
     sources: impl AsRef<Path>,
@@ -60,6 +60,16 @@ dbgDumpMemBlock(const char* label, const BYTE* buf, int size)
 #define      CC_YES       YES
 #define      CC_NO        NO
 
+// Build profile, selected via cargo feature (see build.rs). The default
+// profile matches the Hyper-V vTPM, while the vtpm-minimal profile only
+// implements RSA-2048, ECC NIST P-256, SHA-256 and AES, resulting in smaller
+// object, session, and runtime state structures.
+#ifndef TPM_PROFILE_VTPM_MINIMAL
+#define      TPM_PROFILE_VTPM_MINIMAL   NO
+#endif
+// Algorithms (and curves) which are left out of the vtpm-minimal profile
+#define      ALG_NOT_MINIMAL   (ALG_YES*!TPM_PROFILE_VTPM_MINIMAL)
+
 // Table 0:1 - Defines for Processor Values (DefinesTable)
 #define  BIG_ENDIAN_TPM       NO
 #define  LITTLE_ENDIAN_TPM    YES
@@ -68,7 +78,7 @@ dbgDumpMemBlock(const char* label, const BYTE* buf, int size)
 
 // Table 0:2 - Defines for Implemented Algorithms (ImplementedDefines)
 #define  ALG_RSA               ALG_YES
-#define  ALG_SHA1              ALG_YES
+#define  ALG_SHA1              ALG_NOT_MINIMAL
 #define  ALG_HMAC              ALG_YES
 #define  ALG_TDES              ALG_NO
 #define  ALG_AES               ALG_YES
@@ -76,7 +86,7 @@ dbgDumpMemBlock(const char* label, const BYTE* buf, int size)
 #define  ALG_XOR               ALG_YES
 #define  ALG_KEYEDHASH         ALG_YES
 #define  ALG_SHA256            ALG_YES
-#define  ALG_SHA384            ALG_YES
+#define  ALG_SHA384            ALG_NOT_MINIMAL
 #define  ALG_SHA512            ALG_NO
 #define  ALG_SM3_256           ALG_NO
 #define  ALG_SM4               ALG_NO
@@ -87,9 +97,9 @@ dbgDumpMemBlock(const char* label, const BYTE* buf, int size)
 #define  ALG_ECC               ALG_YES
 #define  ALG_ECDH              (ALG_YES*ALG_ECC)
 #define  ALG_ECDSA             (ALG_YES*ALG_ECC)
-#define  ALG_ECDAA             (ALG_YES*ALG_ECC)
+#define  ALG_ECDAA             (ALG_NOT_MINIMAL*ALG_ECC)
 #define  ALG_SM2               (ALG_NO*ALG_ECC)
-#define  ALG_ECSCHNORR         (ALG_YES*ALG_ECC)
+#define  ALG_ECSCHNORR         (ALG_NOT_MINIMAL*ALG_ECC)
 #define  ALG_ECMQV             (ALG_NO*ALG_ECC)
 #define  ALG_SYMCIPHER         ALG_YES
 #define  ALG_KDF1_SP800_56A    (ALG_YES*ALG_ECC)
@@ -103,8 +113,12 @@ dbgDumpMemBlock(const char* label, const BYTE* buf, int size)
 
 
 // Table 0:3 - Defines for Key Size Constants (KeySizesTable)
+#if TPM_PROFILE_VTPM_MINIMAL
+#define  RSA_KEY_SIZES_BITS         {2048}
+#else
 #define  RSA_KEY_SIZES_BITS         {1024,2048}
 #define  RSA_KEY_SIZE_BITS_1024     RSA_ALLOWED_KEY_SIZE_1024
+#endif
 #define  RSA_KEY_SIZE_BITS_2048     RSA_ALLOWED_KEY_SIZE_2048
 #define  MAX_RSA_KEY_BITS           2048
 #define  MAX_RSA_KEY_BYTES          256
@@ -145,11 +159,11 @@ dbgDumpMemBlock(const char* label, const BYTE* buf, int size)
 
 // Table 0:4 - Defines for Implemented Curves (CurveTableProcessing)
 #define  ECC_NIST_P192         NO
-#define  ECC_NIST_P224         YES
+#define  ECC_NIST_P224         ALG_NOT_MINIMAL
 #define  ECC_NIST_P256         YES
-#define  ECC_NIST_P384         YES
+#define  ECC_NIST_P384         ALG_NOT_MINIMAL
 #define  ECC_NIST_P521         NO
-#define  ECC_BN_P256           YES
+#define  ECC_BN_P256           ALG_NOT_MINIMAL
 #define  ECC_BN_P638           NO
 #define  ECC_SM2_P256          NO
 #define  ECC_CURVES            \
@@ -1625,8 +1639,12 @@ TPM2B_TYPE(SEED, PRIMARY_SEED_SIZE);
 #   error Unable to fingerprint ECC Keysize
 #endif
 
+// bits 56-59 = Build profile fingerprint
+// (the curves implemented aren't otherwise captured by the fingerprint)
+#define FINGERPRINT_PROFILE (TPM_PROFILE_VTPM_MINIMAL * (0x1ull << 56))
+
 #define FINGERPRINT_GENERAL \
-    ( FINGERPRINT_SPEC_VERSION | FINGERPRINT_ALGOS | FINGERPRINT_RSA_KEYSIZE | FINGERPRINT_ECC_KEYSIZE )
+    ( FINGERPRINT_SPEC_VERSION | FINGERPRINT_ALGOS | FINGERPRINT_RSA_KEYSIZE | FINGERPRINT_ECC_KEYSIZE | FINGERPRINT_PROFILE )
 
 #define TPM_IMPLEMENTATION_FINGERPRINT \
     ( FINGERPRINT_ARCH | FINGERPRINT_GENERAL )
@@ -88,7 +88,11 @@
 #endif
 
 // This switch is used to enable the self-test capability in AlgorithmTests.c
-#ifndef SELF_TEST
+//
+// The vtpm-minimal build profile (see Implementation.h) skips self-tests
+// altogether, which would otherwise run on the first use of each algorithm by
+// every instance.
+#if !defined SELF_TEST && !(defined TPM_PROFILE_VTPM_MINIMAL && TPM_PROFILE_VTPM_MINIMAL)
 #define SELF_TEST
 #endif
 
@@ -87,6 +87,15 @@
 #define tpmHashStateSHA512_t      SHA512_CTX
 #define tpmHashStateSM3_256_t     SM3_CTX
 
+// The EVP digest interface is deliberately not used here: the TPM keeps hash
+// state inside HASH_STATE and copies, exports, and imports it with memcpy()
+// (it is also embedded in context blobs, and captured as part of the runtime
+// state), so it must be a plain structure rather than a handle to an
+// EVP_MD_CTX, whose internal state OpenSSL 3.0 provides no way to serialize.
+// The OpenSSL 3.0 default provider digests are themselves built on the same
+// (hardware accelerated) block functions as the SHA*_Init/Update/Final
+// functions bound below.
+
 // The defines below are only needed when compiling CryptHash.c or CryptSmac.c. 
 // This isolation is primarily to avoid name space collision. However, if there 
 // is a real collision, it will likely show up when the linker tries to put things 
@@ -46,6 +46,7 @@
 
 #include <openssl/evp.h>
 #include <openssl/ec.h>
+#include <openssl/err.h>
 
 #define SYMMETRIC_ALIGNMENT RADIX_BYTES
 
@@ -95,12 +96,17 @@
     BIGNUM          *name = BigInitialized(&_##name, initializer)
 
 
+// Number of preallocated points associated with each curve
+#define OSSL_CURVE_SCRATCH_POINTS   3
+
 typedef struct
 {
     const ECC_CURVE_DATA    *C;     // the TPM curve values
     EC_GROUP                *G;     // group parameters
     BN_CTX                  *CTX;   // the context for the math (this might not be
                                     // the context in which the curve was created>;
+    EC_POINT               **points; // preallocated scratch points, shared by all
+                                    // frames of the curve
 } OSSL_CURVE_DATA;
 
 typedef OSSL_CURVE_DATA      *bigCurve;
@@ -47,6 +47,7 @@
 #define SYM_LIB_OSSL
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #if ALG_TDES
 #include <openssl/des.h>
@@ -108,13 +109,32 @@ typedef void(*TpmCryptSetSymKeyCall_t)(
 //***************************************************************
 //** Links to the OpenSSL AES code
 //***************************************************************
+// AES is routed through the EVP interface (see TpmToOsslAesSupport.c) so that
+// the provider's AES-NI / ARMv8 implementation is used rather than the table
+// based AES_encrypt(). The TPM schedule only records the key; the expanded
+// schedule lives in a cached EVP_CIPHER_CTX that is re-keyed when a different
+// schedule is used.
+typedef struct
+{
+    UINT32          serial;         // identifies this key setup to the context
+                                    // cache; never 0 for a valid schedule
+    UINT16          keySizeInBits;
+    BYTE            key[32];
+} OSSL_AES_KEY;
+
+#define tpmKeyScheduleAES           OSSL_AES_KEY
+
+#if ALG_AES
+#include "TpmToOsslAesSupport_fp.h"
+#endif
+
 // Macros to set up the encryption/decryption key schedules
 //
 // AES:
 #define TpmCryptSetEncryptKeyAES(key, keySizeInBits, schedule)                      \
-    AES_set_encrypt_key((key), (keySizeInBits), (tpmKeyScheduleAES *)(schedule))
+    OsslAesSetKey((key), (keySizeInBits), (tpmKeyScheduleAES *)(schedule))
 #define TpmCryptSetDecryptKeyAES(key, keySizeInBits, schedule)                      \
-    AES_set_decrypt_key((key), (keySizeInBits), (tpmKeyScheduleAES *)(schedule))
+    OsslAesSetKey((key), (keySizeInBits), (tpmKeyScheduleAES *)(schedule))
 
 // Macros to alias encryption calls to specific algorithms. This should be used
 // sparingly. Currently, only used by CryptSym.c and CryptRand.c
@@ -122,9 +142,8 @@ typedef void(*TpmCryptSetSymKeyCall_t)(
 // When using these calls, to call the AES block encryption code, the caller
 // should use:
 //      TpmCryptEncryptAES(SWIZZLE(keySchedule, in, out));
-#define TpmCryptEncryptAES          AES_encrypt
-#define TpmCryptDecryptAES          AES_decrypt
-#define tpmKeyScheduleAES           AES_KEY
+#define TpmCryptEncryptAES          OsslAesEncrypt
+#define TpmCryptDecryptAES          OsslAesDecrypt
 
 
 //***************************************************************
@@ -0,0 +1,76 @@
+/* Microsoft Reference Implementation for TPM 2.0
+ *
+ *  The copyright in this software is being made available under the BSD License,
+ *  included below. This software may be subject to other third party and
+ *  contributor rights, including patent rights, and no such rights are granted
+ *  under this license.
+ *
+ *  Copyright (c) Microsoft Corporation
+ *
+ *  All rights reserved.
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice, this list
+ *  of conditions and the following disclaimer.
+ *
+ *  Redistributions in binary form must reproduce the above copyright notice, this
+ *  list of conditions and the following disclaimer in the documentation and/or
+ *  other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ""AS IS""
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ *  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TPM_TO_OSSL_AES_SUPPORT_FP_H_
+#define _TPM_TO_OSSL_AES_SUPPORT_FP_H_
+
+#if (defined SYM_LIB_OSSL) && ALG_AES
+
+//**Functions
+//*** OsslAesSetKey()
+// This function records a key in a TPM AES key schedule. The expensive part of
+// the key setup is deferred until the schedule is first used.
+// Return Type: int
+//      0       success
+//      -2      unsupported key size
+int OsslAesSetKey(
+    const BYTE *key,
+    UINT16 keySizeInBits,
+    tpmKeyScheduleAES *keySchedule);
+
+//*** OsslAesEncrypt()
+// This function encrypts a single block with an AES key schedule.
+void OsslAesEncrypt(
+    const BYTE *in,
+    BYTE *out,
+    tpmKeyScheduleAES *ks);
+
+//*** OsslAesDecrypt()
+// This function decrypts a single block with an AES key schedule.
+void OsslAesDecrypt(
+    const BYTE *in,
+    BYTE *out,
+    tpmKeyScheduleAES *ks);
+
+//*** OsslAesContextReset()
+// This function drops the expanded keys held by the cached contexts. It is called
+// after every call into the TPM library (commands, but also TPM_Manufacture() and
+// _TPM_Init(), which run the DRBG), and before switching instances, so that key
+// material doesn't outlive the call that used it.
+void OsslAesContextReset(
+    void);
+#endif // SYM_LIB_OSSL && ALG_AES
+
+#endif // _TPM_TO_OSSL_AES_SUPPORT_FP_H_
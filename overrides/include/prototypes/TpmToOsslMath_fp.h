@@ -106,6 +106,21 @@ BnDiv(
     bigConst dividend,
     bigConst divisor);
 
+//*** OsslMontCacheSweep()
+// This function frees the cached Montgomery contexts of objects which are no longer
+// loaded, or whose slot has been reused by a different key. It is called at the end
+// of every command, so that the primes of a flushed or evicted object don't outlive
+// the command that removed it.
+void OsslMontCacheSweep(
+    void);
+
+//*** OsslMontCacheFlush()
+// This function frees all cached Montgomery contexts. It is called whenever the
+// runtime state of the TPM is replaced (on _TPM_Init(), and when switching between
+// instances), so that the cache only ever holds contexts for the current instance.
+void OsslMontCacheFlush(
+    void);
+
 #if ALG_RSA
 //*** BnGcd()
 // Get the greatest common divisor of two numbers
@@ -121,7 +136,9 @@ BnGcd(
 
 //***BnModExp()
 // Do modular exponentiation using bigNum values. The conversion from a bignum_t to
-// a bigNum is trivial as they are based on the same structure
+// a bigNum is trivial as they are based on the same structure. For the primes of
+// loaded RSA keys, the Montgomery context is taken from the cache (see
+// MontCacheLookup()).
 //  Return Type: BOOL
 //      TRUE(1)         success
 //      FALSE(0)        failure in operation
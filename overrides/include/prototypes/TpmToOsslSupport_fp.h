@@ -60,6 +60,16 @@ OsslContextEnter(
 void OsslContextLeave(
     BN_CTX *CTX);
 
+//*** OsslContextPoolReset()
+// This function frees the pooled context. BN_CTX_end() doesn't clear the values
+// allocated within a frame, so the pool would otherwise carry key material (RSA
+// primes, ECDSA nonces, private scalars) over into the next command, possibly run
+// on behalf of a different instance. Freeing the context also discards any frames
+// left open by a command aborted by _plat__Fail(). Must only be called between
+// commands.
+void OsslContextPoolReset(
+    void);
+
 //*** OsslPushContext()
 // This function is used to create a frame in a context. All values allocated within
 // this context after the frame is started will be automatically freed when the
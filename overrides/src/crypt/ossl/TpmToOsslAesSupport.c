@@ -0,0 +1,178 @@
+/* Microsoft Reference Implementation for TPM 2.0
+ *
+ *  The copyright in this software is being made available under the BSD License,
+ *  included below. This software may be subject to other third party and
+ *  contributor rights, including patent rights, and no such rights are granted
+ *  under this license.
+ *
+ *  Copyright (c) Microsoft Corporation
+ *
+ *  All rights reserved.
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without modification,
+ *  are permitted provided that the following conditions are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice, this list
+ *  of conditions and the following disclaimer.
+ *
+ *  Redistributions in binary form must reproduce the above copyright notice, this
+ *  list of conditions and the following disclaimer in the documentation and/or
+ *  other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ""AS IS""
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ *  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+//** Introduction
+//
+// The functions in this file bind the TPM AES block interface to the OpenSSL EVP
+// interface.
+//
+// CryptSym.c and CryptRand.c set up a key schedule and then call the block
+// function once per block. Initializing an EVP_CIPHER_CTX is far more expensive
+// than AES_set_encrypt_key(), so the TPM schedule only records the key along with
+// a serial number and the expanded key lives in one of two cached ECB contexts
+// (one per direction). A context is only re-keyed when it is used with a schedule
+// other than the one it was last keyed with.
+
+//** Defines and Includes
+
+#include "Tpm.h"
+
+#if (defined SYM_LIB_OSSL) && ALG_AES
+
+typedef struct
+{
+    EVP_CIPHER_CTX      *ctx;
+    UINT32               serial;    // serial of the schedule the context is keyed
+                                    // with, or 0 if it isn't keyed
+} OSSL_AES_CONTEXT;
+
+static EVP_CIPHER       *s_aesCipher[3];    // AES-128/192/256-ECB
+static OSSL_AES_CONTEXT  s_aesContext[2];   // encrypt, decrypt
+static UINT32            s_aesKeySerial;
+
+//**Functions
+//*** OsslAesSetKey()
+// This function records a key in a TPM AES key schedule. The expensive part of
+// the key setup is deferred until the schedule is first used.
+// Return Type: int
+//      0       success
+//      -2      unsupported key size
+int OsslAesSetKey(
+    const BYTE *key,
+    UINT16 keySizeInBits,
+    tpmKeyScheduleAES *keySchedule)
+{
+    if(keySizeInBits != 128 && keySizeInBits != 192 && keySizeInBits != 256)
+        return -2;
+    // A wrapped serial could match a context keyed with a stale schedule, so
+    // invalidate the contexts when that happens.
+    if(++s_aesKeySerial == 0)
+    {
+        s_aesContext[0].serial = 0;
+        s_aesContext[1].serial = 0;
+        s_aesKeySerial = 1;
+    }
+    keySchedule->serial = s_aesKeySerial;
+    keySchedule->keySizeInBits = keySizeInBits;
+    MemoryCopy(keySchedule->key, key, keySizeInBits / 8);
+    return 0;
+}
+
+//*** OsslAesContextGet()
+// This function returns the cached context for the given direction, keyed with
+// the given schedule.
+static EVP_CIPHER_CTX *
+OsslAesContextGet(
+    const tpmKeyScheduleAES *ks,
+    int enc)
+{
+    static const char *const names[] = {"AES-128-ECB", "AES-192-ECB", "AES-256-ECB"};
+    OSSL_AES_CONTEXT    *context = &s_aesContext[enc ? 0 : 1];
+    int                  index = (ks->keySizeInBits - 128) / 64;
+//
+    if(context->serial == ks->serial)
+        return context->ctx;
+    if(s_aesCipher[index] == NULL)
+        s_aesCipher[index] = EVP_CIPHER_fetch(NULL, names[index], NULL);
+    if(context->ctx == NULL)
+        context->ctx = EVP_CIPHER_CTX_new();
+    if(s_aesCipher[index] == NULL || context->ctx == NULL)
+        FAIL(FATAL_ERROR_ALLOCATION);
+    if(EVP_CipherInit_ex2(context->ctx, s_aesCipher[index], ks->key, NULL, enc,
+                          NULL) != 1
+       || EVP_CIPHER_CTX_set_padding(context->ctx, 0) != 1)
+    {
+        context->serial = 0;
+        FAIL(FATAL_ERROR_INTERNAL);
+    }
+    context->serial = ks->serial;
+    return context->ctx;
+}
+
+//*** OsslAesBlock()
+// This function processes a single block in the given direction.
+static void
+OsslAesBlock(
+    const BYTE *in,
+    BYTE *out,
+    const tpmKeyScheduleAES *ks,
+    int enc)
+{
+    EVP_CIPHER_CTX      *ctx = OsslAesContextGet(ks, enc);
+    int                  outSize;
+//
+    if(EVP_CipherUpdate(ctx, out, &outSize, in, AES_BLOCK_SIZE) != 1
+       || outSize != AES_BLOCK_SIZE)
+        FAIL(FATAL_ERROR_INTERNAL);
+}
+
+//*** OsslAesEncrypt()
+// This function encrypts a single block with an AES key schedule.
+void OsslAesEncrypt(
+    const BYTE *in,
+    BYTE *out,
+    tpmKeyScheduleAES *ks)
+{
+    OsslAesBlock(in, out, ks, 1);
+}
+
+//*** OsslAesDecrypt()
+// This function decrypts a single block with an AES key schedule.
+void OsslAesDecrypt(
+    const BYTE *in,
+    BYTE *out,
+    tpmKeyScheduleAES *ks)
+{
+    OsslAesBlock(in, out, ks, 0);
+}
+
+//*** OsslAesContextReset()
+// This function drops the expanded keys held by the cached contexts. It is called
+// after every call into the TPM library (commands, but also TPM_Manufacture() and
+// _TPM_Init(), which run the DRBG), and before switching instances, so that key
+// material doesn't outlive the call that used it.
+void OsslAesContextReset(
+    void)
+{
+    int                  i;
+//
+    for(i = 0; i < 2; i++)
+    {
+        if(s_aesContext[i].ctx != NULL)
+            EVP_CIPHER_CTX_reset(s_aesContext[i].ctx);
+        s_aesContext[i].serial = 0;
+    }
+}
+
+#endif // SYM_LIB_OSSL && ALG_AES
@@ -306,6 +306,163 @@ Exit:
     return OK;
 }
 
+#if ALG_RSA
+//*** Montgomery Context Cache
+// Setting up the Montgomery context for a modulus is a significant fraction of the
+// cost of an RSA private key operation, so contexts for the primes of loaded RSA
+// keys are cached across calls to BnModExp().
+//
+// The CRT path of RsaPrivateKeyOp() passes the primes of the key in place (i.e.,
+// pointing into the key's slot in s_objects), which is what identifies a private
+// key operation here. Any other modulus (a public key, or a prime candidate being
+// tested during key generation) lives elsewhere and bypasses the cache, so it
+// neither pays for setting up an entry, nor evicts the entries of a loaded key.
+//
+// Each slot of s_objects has its own entries. Since these hold the primes of the
+// key, they are dropped by OsslMontCacheSweep() at the end of the command which
+// flushed (or evicted) the object, and by OsslMontCacheFlush() whenever the runtime
+// state of the TPM is replaced. The cache is not part of the runtime state of the
+// TPM, and is not saved or restored along with it.
+#define MONT_CACHE_PRIMES   2
+
+typedef struct
+{
+    size_t           offset;        // offset of the prime within its OBJECT
+    BIGNUM          *modulus;
+    BN_MONT_CTX     *mont;
+} MONT_CACHE_ENTRY;
+
+extern OBJECT            s_objects[MAX_LOADED_OBJECTS];
+static MONT_CACHE_ENTRY  s_montCache[MAX_LOADED_OBJECTS][MONT_CACHE_PRIMES];
+
+static void
+MontCacheEntryFree(
+    MONT_CACHE_ENTRY    *entry
+)
+{
+    BN_clear_free(entry->modulus);
+    BN_MONT_CTX_free(entry->mont);
+    entry->offset = 0;
+    entry->modulus = NULL;
+    entry->mont = NULL;
+}
+
+//*** MontCacheEntryMatches()
+// This function checks whether 'entry' holds the context for 'modulus'.
+static BOOL
+MontCacheEntryMatches(
+    const MONT_CACHE_ENTRY  *entry,
+    const BIGNUM            *modulus
+)
+{
+    // the size of the modulus is public, but its value is not
+    return entry->modulus != NULL && entry->modulus->top == modulus->top
+           && CRYPTO_memcmp(entry->modulus->d, modulus->d,
+                            modulus->top * sizeof(BN_ULONG)) == 0;
+}
+
+//*** MontCacheLookup()
+// This function returns the cached Montgomery context for 'modulus' (with 'bnM'
+// being its OpenSSL equivalent), setting up a new one if there is no cached
+// context. 'modulus' must be odd.
+//  Return Type: BN_MONT_CTX *
+//      NULL            'modulus' isn't part of a loaded object, or failure to
+//                      allocate or set up the context
+static BN_MONT_CTX *
+MontCacheLookup(
+    bigConst         modulus,
+    const BIGNUM    *bnM,
+    BN_CTX          *CTX
+)
+{
+    uintptr_t            base = (uintptr_t)s_objects;
+    uintptr_t            p = (uintptr_t)modulus;
+    MONT_CACHE_ENTRY    *entries;
+    size_t               offset;
+    int                  i;
+//
+    if(p < base || p >= base + sizeof(s_objects))
+        return NULL;
+    entries = s_montCache[(p - base) / sizeof(OBJECT)];
+    offset = (p - base) % sizeof(OBJECT);
+
+    for(i = 0; i < MONT_CACHE_PRIMES; i++)
+    {
+        if(entries[i].modulus != NULL && entries[i].offset == offset)
+        {
+            if(MontCacheEntryMatches(&entries[i], bnM))
+                return entries[i].mont;
+            // the slot has been reused by a different key
+            break;
+        }
+    }
+    // otherwise, take the first free entry (or the last one, if none are free)
+    if(i == MONT_CACHE_PRIMES)
+        for(i = 0; i < MONT_CACHE_PRIMES - 1 && entries[i].modulus != NULL; i++);
+    MontCacheEntryFree(&entries[i]);
+
+    entries[i].offset = offset;
+    entries[i].modulus = BN_dup(bnM);
+    entries[i].mont = BN_MONT_CTX_new();
+    if(entries[i].modulus == NULL || entries[i].mont == NULL
+       || !BN_MONT_CTX_set(entries[i].mont, bnM, CTX))
+    {
+        MontCacheEntryFree(&entries[i]);
+        return NULL;
+    }
+    return entries[i].mont;
+}
+#endif // ALG_RSA
+
+//*** OsslMontCacheSweep()
+// This function frees the cached Montgomery contexts of objects which are no longer
+// loaded, or whose slot has been reused by a different key. It is called at the end
+// of every command, so that the primes of a flushed or evicted object don't outlive
+// the command that removed it.
+void OsslMontCacheSweep(
+    void)
+{
+#if ALG_RSA
+    MONT_CACHE_ENTRY    *entry;
+    BIGNUM               current;
+    UINT32               slot;
+    int                  i;
+//
+    for(slot = 0; slot < MAX_LOADED_OBJECTS; slot++)
+    {
+        for(i = 0; i < MONT_CACHE_PRIMES; i++)
+        {
+            entry = &s_montCache[slot][i];
+            if(entry->modulus == NULL)
+                continue;
+            // MontCacheEntryMatches() only compares the value if its size matches
+            // that of the cached prime, so this never reads past the object
+            if(!s_objects[slot].attributes.occupied
+               || !MontCacheEntryMatches(entry, BigInitialized(&current,
+                       (bigConst)((BYTE *)&s_objects[slot] + entry->offset))))
+                MontCacheEntryFree(entry);
+        }
+    }
+#endif // ALG_RSA
+}
+
+//*** OsslMontCacheFlush()
+// This function frees all cached Montgomery contexts. It is called whenever the
+// runtime state of the TPM is replaced (on _TPM_Init(), and when switching between
+// instances), so that the cache only ever holds contexts for the current instance.
+void OsslMontCacheFlush(
+    void)
+{
+#if ALG_RSA
+    UINT32               slot;
+    int                  i;
+//
+    for(slot = 0; slot < MAX_LOADED_OBJECTS; slot++)
+        for(i = 0; i < MONT_CACHE_PRIMES; i++)
+            MontCacheEntryFree(&s_montCache[slot][i]);
+#endif // ALG_RSA
+}
+
 #if ALG_RSA
 //*** BnGcd()
 // Get the greatest common divisor of two numbers
@@ -337,7 +494,9 @@ Exit:
 
 //***BnModExp()
 // Do modular exponentiation using bigNum values. The conversion from a bignum_t to
-// a bigNum is trivial as they are based on the same structure
+// a bigNum is trivial as they are based on the same structure. For the primes of
+// loaded RSA keys, the Montgomery context is taken from the cache (see
+// MontCacheLookup()).
 //  Return Type: BOOL
 //      TRUE(1)         success
 //      FALSE(0)        failure in operation
@@ -355,8 +514,16 @@ BnModExp(
     BIG_INITIALIZED(bnN, number);
     BIG_INITIALIZED(bnE, exponent);
     BIG_INITIALIZED(bnM, modulus);
+    BN_MONT_CTX *mont;
     //
-    VERIFY(BN_mod_exp(bnResult, bnN, bnE, bnM, CTX));
+    if(BN_is_odd(bnM) && (mont = MontCacheLookup(modulus, bnM, CTX)) != NULL)
+    {
+        VERIFY(BN_mod_exp_mont(bnResult, bnN, bnE, bnM, CTX, mont));
+    }
+    else
+    {
+        VERIFY(BN_mod_exp(bnResult, bnN, bnE, bnM, CTX));
+    }
     VERIFY(OsslToTpmBn(result, bnResult));
     goto Exit;
 Error:
@@ -433,27 +600,278 @@ PointFromOssl(
 }
 
 //*** EcPointInitialized()
-// Allocate and initialize a point.
+// Initialize a preallocated point.
 static EC_POINT *
 EcPointInitialized(
+    EC_POINT *P,
     pointConst initializer,
     bigCurve E)
 {
-    EC_POINT *P = NULL;
-
     if (initializer != NULL)
     {
         BIG_INITIALIZED(bnX, initializer->x);
         BIG_INITIALIZED(bnY, initializer->y);
         if (E == NULL)
             FAIL(FATAL_ERROR_ALLOCATION);
-        P = EC_POINT_new(E->G);
         if (!EC_POINT_set_affine_coordinates_GFp(E->G, P, bnX, bnY, E->CTX))
             P = NULL;
     }
+    else
+        P = NULL;
     return P;
 }
 
+//*** EcPointsScrub()
+// This function overwrites the curve's scratch points with a public value, so
+// that intermediate values (e.g., ECDH shared secrets) don't linger in memory once
+// an operation is complete.
+static void
+EcPointsScrub(
+    bigCurve E)
+{
+    int i;
+    //
+    for (i = 0; i < OSSL_CURVE_SCRATCH_POINTS; i++)
+        EC_POINT_copy(E->points[i], EC_GROUP_get0_generator(E->G));
+}
+
+//*** Group Cache
+// Creating an EC_GROUP (and validating its generator) is comparatively expensive,
+// so rather than being created on every call to BnCurveInitialize(), groups are
+// created once per curve and cached for the lifetime of the process. Cached groups
+// are never modified after creation, and are shared between all curve frames.
+//
+// Each cached group also has a set of preallocated scratch points, which are used
+// by the BnEcc*() functions in place of allocating new points on each call. Since
+// the TPM library is single threaded, and none of those functions nest, the
+// scratch points can be shared between all curve frames.
+typedef struct
+{
+    TPM_ECC_CURVE            curveId;
+    EC_GROUP                *G;
+    EC_POINT                *points[OSSL_CURVE_SCRATCH_POINTS];
+} OSSL_GROUP_CACHE_ENTRY;
+
+static OSSL_GROUP_CACHE_ENTRY s_groupCache[ECC_CURVE_COUNT];
+
+//*** OsslCurveNid()
+// This function returns the OpenSSL NID of the TPM curve, or NID_undef if OpenSSL
+// doesn't provide a built-in implementation of the curve.
+static int
+OsslCurveNid(
+    TPM_ECC_CURVE curveId
+)
+{
+    switch(curveId)
+    {
+#if ECC_NIST_P192
+        case TPM_ECC_NIST_P192:
+            return NID_X9_62_prime192v1;
+#endif
+#if ECC_NIST_P224
+        case TPM_ECC_NIST_P224:
+            return NID_secp224r1;
+#endif
+#if ECC_NIST_P256
+        case TPM_ECC_NIST_P256:
+            return NID_X9_62_prime256v1;
+#endif
+#if ECC_NIST_P384
+        case TPM_ECC_NIST_P384:
+            return NID_secp384r1;
+#endif
+#if ECC_NIST_P521
+        case TPM_ECC_NIST_P521:
+            return NID_secp521r1;
+#endif
+        default:
+            return NID_undef;
+    }
+}
+
+//*** OsslGroupMatchesCurve()
+// This function checks that a group created from OpenSSL's built-in curve
+// parameters matches the TPM-defined values for the curve.
+//  Return Type: BOOL
+//      TRUE(1)         the group matches the curve
+//      FALSE(0)        the group doesn't match the curve, or there was an error
+static BOOL
+OsslGroupMatchesCurve(
+    const EC_GROUP          *G,
+    const ECC_CURVE_DATA    *C,
+    BN_CTX                  *CTX
+)
+{
+    BOOL OK = FALSE;
+    BIGNUM *p;
+    BIGNUM *a;
+    BIGNUM *b;
+    BIGNUM *x;
+    BIGNUM *y;
+    BIG_INITIALIZED(bnP, C->prime);
+    BIG_INITIALIZED(bnA, C->a);
+    BIG_INITIALIZED(bnB, C->b);
+    BIG_INITIALIZED(bnX, C->base.x);
+    BIG_INITIALIZED(bnY, C->base.y);
+    BIG_INITIALIZED(bnN, C->order);
+    BIG_INITIALIZED(bnH, C->h);
+    //
+    BN_CTX_start(CTX);
+    p = BN_CTX_get(CTX);
+    a = BN_CTX_get(CTX);
+    b = BN_CTX_get(CTX);
+    x = BN_CTX_get(CTX);
+    y = BN_CTX_get(CTX);
+    VERIFY(y != NULL);
+    VERIFY(EC_GROUP_get_curve(G, p, a, b, CTX));
+    VERIFY(EC_POINT_get_affine_coordinates(G, EC_GROUP_get0_generator(G), x, y, CTX));
+    OK = BN_cmp(p, bnP) == 0
+        && BN_cmp(a, bnA) == 0
+        && BN_cmp(b, bnB) == 0
+        && BN_cmp(x, bnX) == 0
+        && BN_cmp(y, bnY) == 0
+        && BN_cmp(EC_GROUP_get0_order(G), bnN) == 0
+        && BN_cmp(EC_GROUP_get0_cofactor(G), bnH) == 0;
+Error:
+    BN_CTX_end(CTX);
+    return OK;
+}
+
+//*** OsslGroupCreate()
+// This function creates the OpenSSL group for a TPM curve.
+//
+// When available, OpenSSL's built-in implementation of the curve is used, as it is
+// typically significantly faster than the generic implementation (e.g., it may
+// include precomputed tables, or an assembly implementation). Otherwise, the group
+// is created from the TPM-defined curve values, and a table of multiples of the
+// generator is precomputed. Note that the generic implementation only uses this
+// table for multi-scalar multiplications (BnEccModMult2(), as used by signature
+// verification); single-scalar multiplications of the generator (key generation,
+// signing) always use the constant-time ladder, and are not sped up by it.
+//  Return Type: EC_GROUP *
+//      NULL        there was a problem creating the group
+//      non-NULL    the newly created group
+static EC_GROUP *
+OsslGroupCreate(
+    TPM_ECC_CURVE            curveId,
+    const ECC_CURVE_DATA    *C,
+    BN_CTX                  *CTX
+)
+{
+    EC_GROUP *G = NULL;
+    EC_POINT *P = NULL;
+    int nid = OsslCurveNid(curveId);
+    BIG_INITIALIZED(bnP, C->prime);
+    BIG_INITIALIZED(bnA, C->a);
+    BIG_INITIALIZED(bnB, C->b);
+    BIG_INITIALIZED(bnX, C->base.x);
+    BIG_INITIALIZED(bnY, C->base.y);
+    BIG_INITIALIZED(bnN, C->order);
+    BIG_INITIALIZED(bnH, C->h);
+    //
+    if(nid != NID_undef)
+    {
+        G = EC_GROUP_new_by_curve_name(nid);
+        if(G != NULL && OsslGroupMatchesCurve(G, C, CTX))
+            return G;
+        EC_GROUP_free(G);
+        G = NULL;
+    }
+
+    // initialize EC group, associate a generator point and initialize the point
+    // from the parameter data
+    // Create a group structure
+    G = EC_GROUP_new_curve_GFp(bnP, bnA, bnB, CTX);
+    VERIFY(G != NULL);
+
+    // Allocate a point in the group that will be used in setting the
+    // generator. This is not needed after the generator is set.
+    P = EC_POINT_new(G);
+    VERIFY(P != NULL);
+
+    // Need to use this in case Montgomery method is being used
+    VERIFY(EC_POINT_set_affine_coordinates_GFp(G, P, bnX, bnY, CTX));
+    // Now set the generator
+    VERIFY(EC_GROUP_set_generator(G, P, bnN, bnH));
+
+    // This only speeds up u1 * G + u2 * Q (i.e., verification), and is purely an
+    // optimization, so failures are not fatal
+    if(!EC_GROUP_precompute_mult(G, CTX))
+        ERR_clear_error();
+
+    EC_POINT_free(P);
+    return G;
+Error:
+    EC_POINT_free(P);
+    EC_GROUP_free(G);
+    return NULL;
+}
+
+//*** OsslGroupCacheEntryInit()
+// This function creates the group and scratch points for a cache entry.
+//  Return Type: BOOL
+//      TRUE(1)         success
+//      FALSE(0)        there was a problem creating the group or points
+static BOOL
+OsslGroupCacheEntryInit(
+    OSSL_GROUP_CACHE_ENTRY  *entry,
+    TPM_ECC_CURVE            curveId,
+    const ECC_CURVE_DATA    *C,
+    BN_CTX                  *CTX
+)
+{
+    int i;
+    //
+    entry->G = OsslGroupCreate(curveId, C, CTX);
+    VERIFY(entry->G != NULL);
+    for (i = 0; i < OSSL_CURVE_SCRATCH_POINTS; i++)
+    {
+        entry->points[i] = EC_POINT_new(entry->G);
+        VERIFY(entry->points[i] != NULL);
+    }
+    entry->curveId = curveId;
+    return TRUE;
+Error:
+    for (i = 0; i < OSSL_CURVE_SCRATCH_POINTS; i++)
+    {
+        EC_POINT_free(entry->points[i]);
+        entry->points[i] = NULL;
+    }
+    EC_GROUP_free(entry->G);
+    entry->G = NULL;
+    return FALSE;
+}
+
+//*** OsslGroupGet()
+// This function returns the cache entry for a curve, creating it if required.
+//  Return Type: OSSL_GROUP_CACHE_ENTRY *
+//      NULL        there was a problem creating the group
+//      non-NULL    the cache entry
+static OSSL_GROUP_CACHE_ENTRY *
+OsslGroupGet(
+    TPM_ECC_CURVE            curveId,
+    const ECC_CURVE_DATA    *C,
+    BN_CTX                  *CTX
+)
+{
+    UINT32 i;
+    //
+    for(i = 0; i < ECC_CURVE_COUNT; i++)
+    {
+        if(s_groupCache[i].G == NULL)
+        {
+            if(!OsslGroupCacheEntryInit(&s_groupCache[i], curveId, C, CTX))
+                return NULL;
+            return &s_groupCache[i];
+        }
+        if(s_groupCache[i].curveId == curveId)
+            return &s_groupCache[i];
+    }
+    // There's a slot for each supported curve, so this should never happen
+    FAIL(FATAL_ERROR_INTERNAL);
+    return NULL;
+}
+
 //*** BnCurveInitialize()
 // This function initializes the OpenSSL curve information structure. This
 // structure points to the TPM-defined values for the curve, to the context for the
@@ -476,38 +894,19 @@ BnCurveInitialize(
         // This creates the OpenSSL memory context that stays in effect as long as the
         // curve (E) is defined.
         OSSL_ENTER(); // if the allocation fails, the TPM fails
-        EC_POINT *P = NULL;
-        BIG_INITIALIZED(bnP, C->prime);
-        BIG_INITIALIZED(bnA, C->a);
-        BIG_INITIALIZED(bnB, C->b);
-        BIG_INITIALIZED(bnX, C->base.x);
-        BIG_INITIALIZED(bnY, C->base.y);
-        BIG_INITIALIZED(bnN, C->order);
-        BIG_INITIALIZED(bnH, C->h);
+        OSSL_GROUP_CACHE_ENTRY *entry;
         //
         E->C = C;
         E->CTX = CTX;
 
-        // initialize EC group, associate a generator point and initialize the point
-        // from the parameter data
-        // Create a group structure
-        E->G = EC_GROUP_new_curve_GFp(bnP, bnA, bnB, CTX);
-        VERIFY(E->G != NULL);
-
-        // Allocate a point in the group that will be used in setting the
-        // generator. This is not needed after the generator is set.
-        P = EC_POINT_new(E->G);
-        VERIFY(P != NULL);
-
-        // Need to use this in case Montgomery method is being used
-        VERIFY(EC_POINT_set_affine_coordinates_GFp(E->G, P, bnX, bnY, CTX));
-        // Now set the generator
-        VERIFY(EC_GROUP_set_generator(E->G, P, bnN, bnH));
+        // The group is shared with other curve frames, and must not be modified
+        entry = OsslGroupGet(curveId, C, CTX);
+        VERIFY(entry != NULL);
+        E->G = entry->G;
+        E->points = entry->points;
 
-        EC_POINT_free(P);
         goto Exit;
     Error:
-        EC_POINT_free(P);
         BnCurveFree(E);
         E = NULL;
     }
@@ -516,15 +915,14 @@ Exit:
 }
 
 //*** BnCurveFree()
-// This function will free the allocated components of the curve and end the
-// frame in which the curve data exists
+// This function will end the frame in which the curve data exists. The group
+// is cached, and is not freed.
 LIB_EXPORT void
 BnCurveFree(
     bigCurve E)
 {
     if (E)
     {
-        EC_GROUP_free(E->G);
         OsslContextLeave(E->CTX);
     }
 }
@@ -541,8 +939,8 @@ BnEccModMult(
     bigConst d,   // IN: scalar for [d]S
     bigCurve E)
 {
-    EC_POINT *pR = EC_POINT_new(E->G);
-    EC_POINT *pS = EcPointInitialized(S, E);
+    EC_POINT *pR = E->points[0];
+    EC_POINT *pS = EcPointInitialized(E->points[1], S, E);
     BIG_INITIALIZED(bnD, d);
 
     if (S == NULL)
@@ -550,8 +948,7 @@ BnEccModMult(
     else
         EC_POINT_mul(E->G, pR, NULL, pS, bnD, E->CTX);
     PointFromOssl(R, pR, E);
-    EC_POINT_free(pR);
-    EC_POINT_free(pS);
+    EcPointsScrub(E);
     return !BnEqualZero(R->z);
 }
 
@@ -570,10 +967,10 @@ BnEccModMult2(
     bigCurve E    // IN: curve
 )
 {
-    EC_POINT *pR = EC_POINT_new(E->G);
-    EC_POINT *pS = EcPointInitialized(S, E);
+    EC_POINT *pR = E->points[0];
+    EC_POINT *pS = EcPointInitialized(E->points[1], S, E);
     BIG_INITIALIZED(bnD, d);
-    EC_POINT *pQ = EcPointInitialized(Q, E);
+    EC_POINT *pQ = EcPointInitialized(E->points[2], Q, E);
     BIG_INITIALIZED(bnU, u);
 
     if (S == NULL || S == (pointConst) & (AccessCurveData(E)->base))
@@ -589,9 +986,7 @@ BnEccModMult2(
         EC_POINTs_mul(E->G, pR, NULL, 2, points, scalars, E->CTX);
     }
     PointFromOssl(R, pR, E);
-    EC_POINT_free(pR);
-    EC_POINT_free(pS);
-    EC_POINT_free(pQ);
+    EcPointsScrub(E);
     return !BnEqualZero(R->z);
 }
 
@@ -608,16 +1003,14 @@ BnEccAdd(
     bigCurve E    // IN: curve
 )
 {
-    EC_POINT *pR = EC_POINT_new(E->G);
-    EC_POINT *pS = EcPointInitialized(S, E);
-    EC_POINT *pQ = EcPointInitialized(Q, E);
+    EC_POINT *pR = E->points[0];
+    EC_POINT *pS = EcPointInitialized(E->points[1], S, E);
+    EC_POINT *pQ = EcPointInitialized(E->points[2], Q, E);
     //
     EC_POINT_add(E->G, pR, pS, pQ, E->CTX);
 
     PointFromOssl(R, pR, E);
-    EC_POINT_free(pR);
-    EC_POINT_free(pS);
-    EC_POINT_free(pQ);
+    EcPointsScrub(E);
     return !BnEqualZero(R->z);
 }
 
@@ -54,16 +54,25 @@ SupportLibInit(
     return TRUE;
 }
 
+static BN_CTX      *s_pooledContext = NULL;
+
 //*** OsslContextEnter()
 // This function is used to initialize an OpenSSL context at the start of a function
 // that will call to an OpenSSL math function.
+//
+// Rather than allocating a new context on each call, a single pooled context is
+// lazily allocated and reused for the rest of the command, with each
+// OsslContextEnter()/OsslContextLeave() pair corresponding to a frame within the
+// pooled context. Since the TPM library is single threaded, a single pooled context
+// is sufficient.
 BN_CTX *
 OsslContextEnter(
     void)
 {
-    BN_CTX *CTX = BN_CTX_new();
+    if(s_pooledContext == NULL)
+        s_pooledContext = BN_CTX_new();
     //
-    return OsslPushContext(CTX);
+    return OsslPushContext(s_pooledContext);
 }
 
 //*** OsslContextLeave()
@@ -72,7 +81,21 @@ void OsslContextLeave(
     BN_CTX *CTX)
 {
     OsslPopContext(CTX);
-    BN_CTX_free(CTX);
+}
+
+//*** OsslContextPoolReset()
+// This function frees the pooled context. BN_CTX_end() doesn't clear the values
+// allocated within a frame, so the pool would otherwise carry key material (RSA
+// primes, ECDSA nonces, private scalars) over into the next command, possibly run
+// on behalf of a different instance. Freeing the context also discards any frames
+// left open by a command aborted by _plat__Fail(). Must only be called between
+// commands.
+void OsslContextPoolReset(
+    void)
+{
+    // BN_CTX_free() clears every value in the pool before freeing it
+    BN_CTX_free(s_pooledContext);
+    s_pooledContext = NULL;
 }
 
 //*** OsslPushContext()
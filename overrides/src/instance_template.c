@@ -0,0 +1,45 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+// Hooks to stamp out new TPM instances from a manufactured template
+//
+// Manufacturing a TPM from scratch for every new instance is wasteful, as most
+// of what TPM_Manufacture sets up is identical across instances. Instead, a
+// single instance can be manufactured once, with its NV state being used as a
+// template for any number of new instances. Each instance must then be given
+// its own secrets, which is what the hooks in this file take care of.
+
+#include "Tpm.h"
+
+//
+// Re-randomize all per-instance secrets of a freshly loaded template.
+//
+// Must be called after _TPM_Init, and before TPM2_Startup.
+//
+// The seeds of the primary hierarchies (EPS/SPS/PPS) and the hierarchy proofs
+// are regenerated exactly as TPM_Manufacture would have. The DRBG state saved
+// in the template's orderly data is discarded as well, as instances sharing it
+// would otherwise produce identical random streams (and subsequently,
+// identical null hierarchy seeds).
+//
+// Returns 0 on success.
+//
+int INJECTED_ReseedManufacturedState(void)
+{
+    if(g_inFailureMode)
+        return -1;
+
+    // Re-instantiate the DRBG from fresh platform entropy, so that none of the
+    // secrets generated below are derived from template state.
+    if(!DRBG_Instantiate(&drbgDefault, 0, NULL))
+        return -2;
+    NvWrite(NV_ORDERLY, sizeof(go), &go);
+
+    // Regenerates the primary seeds and hierarchy proofs, and resets
+    // hierarchy authValues and policies to their manufactured defaults.
+    HierarchyPreInstall_Init();
+
+    if(!NvCommit())
+        return -3;
+
+    return 0;
+}
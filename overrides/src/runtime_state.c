@@ -52,6 +52,14 @@ static const uint32_t s_RuntimeStateRevision = 3;
 //
 typedef struct tag_TPM_RUNTIME_STATE_ENTRY
 {
+    //
+    // Stable identifier for a variable, used by the tagged runtime state format.
+    //
+    // IDs must never be re-assigned or re-used. New variables must be given a
+    // new ID, and the IDs of removed variables must be retired.
+    //
+    const uint32_t Id;
+
     //
     // Pointer to a variable.
     //
@@ -69,56 +77,56 @@ typedef struct tag_TPM_RUNTIME_STATE_ENTRY
 //
 static const TPM_RUNTIME_STATE_ENTRY s_TpmRuntimeVariables[] =
     {
-        {(char *)&g_exclusiveAuditSession, sizeof(g_exclusiveAuditSession)},
-        {(char *)&g_time, sizeof(g_time)},
-        {(char *)&g_phEnable, sizeof(g_phEnable)},
-        {(char *)&g_pcrReConfig, sizeof(g_pcrReConfig)},
-        {(char *)&g_DRTMHandle, sizeof(g_DRTMHandle)},
-        {(char *)&g_DrtmPreStartup, sizeof(g_DrtmPreStartup)},
-        {(char *)&g_StartupLocality3, sizeof(g_StartupLocality3)},
-        {(char *)&g_daUsed, sizeof(g_daUsed)},
-        {(char *)&g_updateNV, sizeof(g_updateNV)},
-        {(char *)&g_powerWasLost, sizeof(g_powerWasLost)},
-        {(char *)&g_clearOrderly, sizeof(g_clearOrderly)},
-        {(char *)&g_prevOrderlyState, sizeof(g_prevOrderlyState)},
-        {(char *)&g_nvOk, sizeof(g_nvOk)},
-        {(char *)&g_NvStatus, sizeof(g_NvStatus)},
+        {1, (char *)&g_exclusiveAuditSession, sizeof(g_exclusiveAuditSession)},
+        {2, (char *)&g_time, sizeof(g_time)},
+        {3, (char *)&g_phEnable, sizeof(g_phEnable)},
+        {4, (char *)&g_pcrReConfig, sizeof(g_pcrReConfig)},
+        {5, (char *)&g_DRTMHandle, sizeof(g_DRTMHandle)},
+        {6, (char *)&g_DrtmPreStartup, sizeof(g_DrtmPreStartup)},
+        {7, (char *)&g_StartupLocality3, sizeof(g_StartupLocality3)},
+        {8, (char *)&g_daUsed, sizeof(g_daUsed)},
+        {9, (char *)&g_updateNV, sizeof(g_updateNV)},
+        {10, (char *)&g_powerWasLost, sizeof(g_powerWasLost)},
+        {11, (char *)&g_clearOrderly, sizeof(g_clearOrderly)},
+        {12, (char *)&g_prevOrderlyState, sizeof(g_prevOrderlyState)},
+        {13, (char *)&g_nvOk, sizeof(g_nvOk)},
+        {14, (char *)&g_NvStatus, sizeof(g_NvStatus)},
         // {(char *)&g_platformUniqueAuthorities, sizeof(g_platformUniqueAuthorities)}, // not ref'd
-        {(char *)&g_platformUniqueDetails, sizeof(g_platformUniqueDetails)},
-        {(char *)&gp, sizeof(gp)},
-        {(char *)&go, sizeof(go)},
-        {(char *)&gc, sizeof(gc)},
-        {(char *)&gr, sizeof(gr)},
-        {(char *)&g_manufactured, sizeof(g_manufactured)},
-        {(char *)&g_initialized, sizeof(g_initialized)},
-        {(char *)s_sessionHandles, sizeof(s_sessionHandles)},
-        {(char *)s_attributes, sizeof(s_attributes)},
-        {(char *)s_associatedHandles, sizeof(s_associatedHandles)},
-        {(char *)s_nonceCaller, sizeof(s_nonceCaller)},
-        {(char *)s_inputAuthValues, sizeof(s_inputAuthValues)},
+        {15, (char *)&g_platformUniqueDetails, sizeof(g_platformUniqueDetails)},
+        {16, (char *)&gp, sizeof(gp)},
+        {17, (char *)&go, sizeof(go)},
+        {18, (char *)&gc, sizeof(gc)},
+        {19, (char *)&gr, sizeof(gr)},
+        {20, (char *)&g_manufactured, sizeof(g_manufactured)},
+        {21, (char *)&g_initialized, sizeof(g_initialized)},
+        {22, (char *)s_sessionHandles, sizeof(s_sessionHandles)},
+        {23, (char *)s_attributes, sizeof(s_attributes)},
+        {24, (char *)s_associatedHandles, sizeof(s_associatedHandles)},
+        {25, (char *)s_nonceCaller, sizeof(s_nonceCaller)},
+        {26, (char *)s_inputAuthValues, sizeof(s_inputAuthValues)},
         // {(char *)s_usedSessions, sizeof(s_usedSessions)}, // pointer
-        {(char *)&s_encryptSessionIndex, sizeof(s_encryptSessionIndex)},
-        {(char *)&s_decryptSessionIndex, sizeof(s_decryptSessionIndex)},
-        {(char *)&s_auditSessionIndex, sizeof(s_auditSessionIndex)},
-        {(char *)&s_cpHashForCommandAudit, sizeof(s_cpHashForCommandAudit)},
-        {(char *)&s_DAPendingOnNV, sizeof(s_DAPendingOnNV)},
-        {(char *)&s_selfHealTimer, sizeof(s_selfHealTimer)},
+        {27, (char *)&s_encryptSessionIndex, sizeof(s_encryptSessionIndex)},
+        {28, (char *)&s_decryptSessionIndex, sizeof(s_decryptSessionIndex)},
+        {29, (char *)&s_auditSessionIndex, sizeof(s_auditSessionIndex)},
+        {30, (char *)&s_cpHashForCommandAudit, sizeof(s_cpHashForCommandAudit)},
+        {31, (char *)&s_DAPendingOnNV, sizeof(s_DAPendingOnNV)},
+        {32, (char *)&s_selfHealTimer, sizeof(s_selfHealTimer)},
         // {(char *)&s_evictNvEnd, sizeof(s_evictNvEnd)},  // pointer
-        {(char *)&s_indexOrderlyRam, sizeof(s_indexOrderlyRam)},
-        {(char *)&s_maxCounter, sizeof(s_maxCounter)},
-        {(char *)&s_cachedNvIndex, sizeof(s_cachedNvIndex)},
+        {33, (char *)&s_indexOrderlyRam, sizeof(s_indexOrderlyRam)},
+        {34, (char *)&s_maxCounter, sizeof(s_maxCounter)},
+        {35, (char *)&s_cachedNvIndex, sizeof(s_cachedNvIndex)},
         // {(char *)&s_cachedNvRef, sizeof(s_cachedNvRef)},  // pointer
         // {(char *)&s_cachedNvRamRef, sizeof(s_cachedNvRamRef)}, // pointer
-        {(char *)s_objects, sizeof(s_objects)},
-        {(char *)s_pcrs, sizeof(s_pcrs)},
-        {(char *)s_sessions, sizeof(s_sessions)},
-        {(char *)&s_oldestSavedSession, sizeof(s_oldestSavedSession)},
-        {(char *)&s_freeSessionSlots, sizeof(s_freeSessionSlots)},
-        {(char *)&g_inFailureMode, sizeof(g_inFailureMode)},
-        {(char *)&g_forceFailureMode, sizeof(g_forceFailureMode)},
+        {36, (char *)s_objects, sizeof(s_objects)},
+        {37, (char *)s_pcrs, sizeof(s_pcrs)},
+        {38, (char *)s_sessions, sizeof(s_sessions)},
+        {39, (char *)&s_oldestSavedSession, sizeof(s_oldestSavedSession)},
+        {40, (char *)&s_freeSessionSlots, sizeof(s_freeSessionSlots)},
+        {41, (char *)&g_inFailureMode, sizeof(g_inFailureMode)},
+        {42, (char *)&g_forceFailureMode, sizeof(g_forceFailureMode)},
         // {(char *)&s_failFunction, sizeof(s_failFunction)}, // pointer
-        {(char *)&s_failLine, sizeof(s_failLine)},
-        {(char *)&s_failCode, sizeof(s_failCode)}
+        {43, (char *)&s_failLine, sizeof(s_failLine)},
+        {44, (char *)&s_failCode, sizeof(s_failCode)}
         //
 };
 
@@ -219,3 +227,111 @@ int INJECTED_ApplyRuntimeState(
 
     return 0;
 }
+
+//
+// Alignment of each variable within a runtime state arena.
+//
+#define RUNTIME_ARENA_ALIGNMENT 64
+
+#define ARENA_ALIGN(size) \
+    (((size) + RUNTIME_ARENA_ALIGNMENT - 1) & ~(uint32_t)(RUNTIME_ARENA_ALIGNMENT - 1))
+
+// Returns the size of a runtime state arena.
+//
+// Unlike the runtime state blob, an arena has no header, and places each
+// variable at a cache-line aligned offset. It is only ever meant to be used to
+// stash the state of a live TPM instance in host memory, and is not a stable
+// serialization format.
+uint32_t INJECTED_GetRuntimeArenaSize(void)
+{
+    uint32_t totalSize = 0;
+    uint32_t i;
+
+    for (i = 0; i < ARRAY_SIZE(s_TpmRuntimeVariables); i++)
+    {
+        totalSize += ARENA_ALIGN(s_TpmRuntimeVariables[i].cbVariableSize);
+    }
+
+    return totalSize;
+}
+
+// Saves the live runtime state into pSaveArena, and replaces it with the state
+// from pLoadArena, in a single pass over the runtime variables.
+//
+// Either arena may be NULL, in which case the live state is (respectively)
+// discarded, or left as-is. Both arenas must be at least
+// INJECTED_GetRuntimeArenaSize() bytes large, and must not overlap.
+//
+// Returns:
+// - 0 on success
+// - 1 for invalid arg
+int INJECTED_SwapRuntimeState(
+    void *pSaveArena,
+    const void *pLoadArena,
+    uint32_t arenaSize)
+{
+    if (arenaSize < INJECTED_GetRuntimeArenaSize())
+    {
+        return 1;
+    }
+
+    char *pSave = (char *)pSaveArena;
+    const char *pLoad = (const char *)pLoadArena;
+    uint32_t offset = 0;
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(s_TpmRuntimeVariables); i++)
+    {
+        void *pVariable = (void *)s_TpmRuntimeVariables[i].pbRuntimeVariable;
+        uint32_t size = s_TpmRuntimeVariables[i].cbVariableSize;
+
+        if (pSave != NULL)
+        {
+            memcpy(pSave + offset, pVariable, size);
+        }
+        if (pLoad != NULL)
+        {
+            memcpy(pVariable, pLoad + offset, size);
+        }
+
+        offset += ARENA_ALIGN(size);
+    }
+
+    return 0;
+}
+
+// Returns the fingerprint of the build-time choices which determine the
+// layout of the runtime variables.
+uint64_t INJECTED_GetImplementationFingerprint(void)
+{
+    return TPM_IMPLEMENTATION_FINGERPRINT;
+}
+
+uint32_t INJECTED_GetRuntimeVariableCount(void)
+{
+    return ARRAY_SIZE(s_TpmRuntimeVariables);
+}
+
+// Enumerates the runtime variables, allowing them to be individually saved
+// and restored.
+//
+// Returns:
+// - 0 on success
+// - 1 for invalid arg
+int INJECTED_GetRuntimeVariable(
+    uint32_t index,
+    uint32_t *pId,
+    void **ppVariable,
+    uint32_t *pSize)
+{
+    if (index >= ARRAY_SIZE(s_TpmRuntimeVariables) ||
+        pId == NULL || ppVariable == NULL || pSize == NULL)
+    {
+        return 1;
+    }
+
+    *pId = s_TpmRuntimeVariables[index].Id;
+    *ppVariable = (void *)s_TpmRuntimeVariables[index].pbRuntimeVariable;
+    *pSize = s_TpmRuntimeVariables[index].cbVariableSize;
+
+    return 0;
+}
@@ -28,6 +28,14 @@ pub enum Error {
     InvalidRestoreSize,
     /// Invalid saved state format
     InvalidRestoreFormat,
+    /// Snapshot is not the most recent snapshot of the instance
+    UnknownSnapshot,
+    /// Current state does not match the base state of a state delta
+    DeltaBaseMismatch,
+    /// I/O error while streaming saved state
+    StateStreamIo(std::io::Error),
+    /// Failed to spawn the engine thread of an async platform
+    EngineThread(std::io::Error),
 }
 
 /// Alias for `Result<T, Box<dyn std::error::Error + Send + Sync>>`
@@ -59,6 +67,10 @@ impl fmt::Display for Error {
             FailedPlatformRestore(e) => write!(f, "failed restore: {}", e),
             InvalidRestoreSize => write!(f, "invalid saved state size"),
             InvalidRestoreFormat => write!(f, "invalid saved state format"),
+            UnknownSnapshot => write!(f, "snapshot is not the most recent snapshot"),
+            DeltaBaseMismatch => write!(f, "state does not match base state of delta"),
+            StateStreamIo(e) => write!(f, "i/o error while streaming saved state: {}", e),
+            EngineThread(e) => write!(f, "failed to spawn engine thread: {}", e),
         }
     }
 }
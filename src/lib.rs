@@ -6,14 +6,26 @@
 
 mod error;
 mod plat;
+mod resource_manager;
 mod tpmlib_state;
 
 pub use error::DynResult;
 pub use error::Error;
+pub use plat::AsyncMsTpm20RefPlatform;
+pub use plat::CancelHandle;
+pub use plat::CommandSlot;
+pub use plat::CommandStats;
+pub use plat::InstanceTemplate;
 pub use plat::MsTpm20RefPlatform;
 pub use plat::MsTpm20RefRuntimeState;
+pub use plat::PlatformFuture;
+pub use plat::PlatformMetrics;
+pub use plat::SnapshotId;
+pub use plat::HISTOGRAM_BUCKETS;
+pub use resource_manager::ResourceManager;
 
 use std::borrow::Cow;
+use std::time::Duration;
 
 /// Various library initialization modes
 pub enum InitKind<'a> {
@@ -25,6 +37,30 @@ pub enum InitKind<'a> {
         /// Opaque nvmem blob
         nvmem_blob: Cow<'a, [u8]>,
     },
+    /// Initialize the TPM using a caller-provided NV region (e.g: a
+    /// memory-mapped file), which will be read and written in-place.
+    ///
+    /// The platform callbacks are still notified on each NV commit.
+    ColdInitWithNvRegion {
+        /// Backing memory for the NV region, which must be exactly as large
+        /// as the TPM library's NV memory (32 KiB).
+        region: &'static mut [u8],
+        /// If set, the region is zeroed, and the TPM manufactures a fresh NV
+        /// state into it (as with [`InitKind::ColdInit`]). Otherwise, the
+        /// region must contain an existing NV blob.
+        manufacture: bool,
+    },
+    /// Initialize the TPM from a previously manufactured
+    /// [`InstanceTemplate`], as a much cheaper alternative to
+    /// [`InitKind::ColdInit`].
+    ///
+    /// The new instance starts out with the template's NV state, but with its
+    /// own freshly generated primary seeds (EPS/SPS/PPS), hierarchy proofs, and
+    /// DRBG state. The full NV state is persisted on the first NV commit.
+    ColdInitFromTemplate {
+        /// Template to provision the instance from
+        template: &'a InstanceTemplate,
+    },
 }
 
 impl core::fmt::Debug for InitKind<'_> {
@@ -34,15 +70,165 @@ impl core::fmt::Debug for InitKind<'_> {
             InitKind::ColdInitWithPersistentState { .. } => {
                 write!(f, "ColdInitWithPersistentState {{ .. }}")
             }
+            InitKind::ColdInitWithNvRegion { manufacture, .. } => {
+                write!(
+                    f,
+                    "ColdInitWithNvRegion {{ manufacture: {}, .. }}",
+                    manufacture
+                )
+            }
+            InitKind::ColdInitFromTemplate { .. } => write!(f, "ColdInitFromTemplate {{ .. }}"),
+        }
+    }
+}
+
+/// Optional platform configuration, used alongside
+/// [`MsTpm20RefPlatform::initialize_with_config`].
+#[derive(Debug, Clone, Default)]
+#[non_exhaustive]
+pub struct PlatformConfig {
+    /// Policy for persisting NV commits. Defaults to
+    /// [`NvCommitPolicy::WriteThrough`].
+    pub nv_commit_policy: NvCommitPolicy,
+    /// Collect per-command latency histograms and platform counters, exposed
+    /// via [`MsTpm20RefPlatform::metrics`]. Defaults to `false`.
+    ///
+    /// Collection is lock-free, but does involve reading the system clock
+    /// around each command and platform callback.
+    pub metrics: bool,
+    /// Buffer platform entropy in memory, batching calls to
+    /// [`PlatformCallbacks::get_crypt_random`]. Defaults to `None` (i.e: every
+    /// request for entropy from the TPM library invokes the callback).
+    pub entropy_pool: Option<EntropyPoolConfig>,
+    /// Sample [`PlatformCallbacks::monotonic_timer`] once at the start of each
+    /// command, and serve every timer read the TPM library makes during that
+    /// command from the sampled value. Defaults to `false`.
+    ///
+    /// Time as observed by the TPM library then only advances between
+    /// commands, which is indistinguishable from a slightly coarser timer
+    /// for all but the longest running commands (e.g: RSA key generation).
+    pub coarse_clock: bool,
+    /// Save state using a compact encoding, which omits zero-filled pages of
+    /// the NV region and C library state. Defaults to `false`.
+    ///
+    /// Applies to [`MsTpm20RefPlatform::save_state`],
+    /// [`MsTpm20RefPlatform::save_state_stream`], and the full blob returned
+    /// by [`MsTpm20RefPlatform::save_state_snapshot`] (deltas use their own
+    /// encoding, which only contains changed chunks). Restoring always accepts
+    /// either encoding, but versions of this crate predating the compact
+    /// encoding will reject compact saved state.
+    pub compact_saved_state: bool,
+}
+
+/// Configuration for the platform entropy pool. See
+/// [`PlatformConfig::entropy_pool`].
+///
+/// Requests from the TPM library are served from the pool, which is refilled
+/// up to `high_watermark` bytes between commands whenever it has fallen below
+/// `low_watermark` bytes. Requests larger than what is left in the pool
+/// trigger an immediate refill.
+///
+/// Pooled entropy is never included in saved state.
+#[derive(Debug, Clone, Copy)]
+#[non_exhaustive]
+pub struct EntropyPoolConfig {
+    /// Refill the pool between commands once it holds fewer than this many
+    /// bytes.
+    pub low_watermark: usize,
+    /// Size the pool is refilled to.
+    pub high_watermark: usize,
+}
+
+impl EntropyPoolConfig {
+    /// Create a new entropy pool configuration.
+    pub fn new(low_watermark: usize, high_watermark: usize) -> EntropyPoolConfig {
+        EntropyPoolConfig {
+            low_watermark,
+            high_watermark,
         }
     }
 }
 
+impl Default for EntropyPoolConfig {
+    fn default() -> EntropyPoolConfig {
+        EntropyPoolConfig::new(256, 4096)
+    }
+}
+
+/// Durability policy for NV commits issued by the TPM library.
+#[derive(Debug, Clone, Copy, Default)]
+pub enum NvCommitPolicy {
+    /// Every NV commit synchronously invokes the NV commit callbacks, and
+    /// commands complete only once NV state has been persisted.
+    #[default]
+    WriteThrough,
+    /// NV commits are staged in memory, and persisted from a background thread
+    /// once either `max_delay` has elapsed since the first unpersisted commit,
+    /// or `max_commits` commits have been staged.
+    ///
+    /// Commands which modify NV state may complete _before_ the modification
+    /// has been persisted. As such, a host crash may lose any commits staged
+    /// within the last `max_delay`.
+    ///
+    /// Staged commits are synchronously flushed on an orderly TPM2_Shutdown,
+    /// as part of [`MsTpm20RefPlatform::reset`], on
+    /// [`MsTpm20RefPlatform::flush_nv_commits`], and when the platform is
+    /// dropped. Errors from background commits are reported to the TPM
+    /// library on the subsequent commit.
+    ///
+    /// NOTE: In this mode, platform callbacks may be invoked from the
+    /// background thread, though never concurrently with one another. If the
+    /// platform provides dedicated
+    /// [`PlatformCallbacks::nv_commit_callbacks`], the background thread only
+    /// ever uses those.
+    Coalesced {
+        /// Maximum amount of time a commit may remain unpersisted.
+        max_delay: Duration,
+        /// Maximum number of commits to coalesce into a single flush.
+        max_commits: u32,
+    },
+}
+
 /// Implementation-specific platform callbacks.
 pub trait PlatformCallbacks {
     /// Persist the provided non volatile state.
     fn commit_nv_state(&mut self, state: &[u8]) -> DynResult<()>;
 
+    /// Persist the provided non volatile state, given the list of
+    /// `(offset, data)` ranges which have changed since the last successful
+    /// commit.
+    ///
+    /// Platforms with expensive writes can override this method to only
+    /// persist the changed ranges. The full `state` is provided as well, and
+    /// is identical to what would have been passed to
+    /// [`commit_nv_state`](Self::commit_nv_state).
+    ///
+    /// If a commit fails, its ranges will be included in the next commit.
+    /// Ranges may be reported as changed even if their contents have been
+    /// written back with identical data.
+    ///
+    /// The default implementation calls `commit_nv_state`.
+    fn commit_nv_delta(&mut self, state: &[u8], dirty: &[(usize, &[u8])]) -> DynResult<()> {
+        let _ = dirty;
+        self.commit_nv_state(state)
+    }
+
+    /// Return dedicated callbacks for persisting NV state from the background
+    /// thread used by [`NvCommitPolicy::Coalesced`].
+    ///
+    /// Called once, when the platform is initialized with that policy. With
+    /// dedicated callbacks, background commits proceed without blocking the
+    /// other callbacks (which the TPM library invokes while executing
+    /// commands), and all NV commits are made through the returned callbacks.
+    ///
+    /// The default implementation returns `None`, in which case background
+    /// commits are made through [`commit_nv_delta`](Self::commit_nv_delta),
+    /// and any callbacks made by a command wait for an in-progress background
+    /// commit to complete.
+    fn nv_commit_callbacks(&mut self) -> Option<Box<dyn NvCommitCallbacks>> {
+        None
+    }
+
     /// Write cryptographically secure random bytes into `buf`.
     ///
     /// Returns the number of bytes written into `buf`.
@@ -61,6 +247,14 @@ pub trait PlatformCallbacks {
     fn get_unique_value(&self) -> &'static [u8];
 }
 
+/// NV commit callbacks which can be used independently of the rest of the
+/// [`PlatformCallbacks`]. See [`PlatformCallbacks::nv_commit_callbacks`].
+pub trait NvCommitCallbacks: Send {
+    /// Persist the provided non volatile state, as per
+    /// [`PlatformCallbacks::commit_nv_delta`].
+    fn commit_nv_delta(&mut self, state: &[u8], dirty: &[(usize, &[u8])]) -> DynResult<()>;
+}
+
 /// A noop implementation of [`PlatformCallbacks`]` that simply logs invocations
 /// + returns dummy data.
 pub struct NoopPlatformCallbacks;
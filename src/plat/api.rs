@@ -2,11 +2,7 @@
 
 macro_rules! platform {
     () => {
-        crate::plat::PLATFORM
-            .try_lock()
-            .expect("TPM platform is neither reentrant or multithread capable!")
-            .as_mut()
-            .expect("called platform function prior to initialization")
+        crate::plat::ActivePlatform::get()
     };
 }
 
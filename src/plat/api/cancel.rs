@@ -2,6 +2,10 @@
 
 //! Cancel.c
 
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+
 use serde::Deserialize;
 use serde::Serialize;
 
@@ -18,9 +22,53 @@ impl CancelState {
     }
 }
 
+/// A handle which can abort the command being executed by a TPM instance,
+/// without requiring access to the instance itself.
+///
+/// Obtained via [`MsTpm20RefPlatform::cancel_handle`] or
+/// [`AsyncMsTpm20RefPlatform::cancel_handle`], and can be freely cloned and
+/// shared across threads.
+///
+/// [`MsTpm20RefPlatform::cancel_handle`]: crate::MsTpm20RefPlatform::cancel_handle
+/// [`AsyncMsTpm20RefPlatform::cancel_handle`]: crate::AsyncMsTpm20RefPlatform::cancel_handle
+#[derive(Debug, Clone)]
+pub struct CancelHandle {
+    requested: Arc<AtomicBool>,
+}
+
+impl CancelHandle {
+    pub(crate) fn new() -> CancelHandle {
+        CancelHandle {
+            requested: Arc::new(AtomicBool::new(false)),
+        }
+    }
+
+    /// Request that the command currently being executed is aborted. If no
+    /// command is being executed, the next command to be executed is aborted
+    /// instead.
+    ///
+    /// Like the cancel flag set via
+    /// [`MsTpm20RefPlatform::set_cancel_flag`](crate::MsTpm20RefPlatform::set_cancel_flag),
+    /// cancellation is opportunistic: the TPM library only checks for it at
+    /// certain points in long-running operations (e.g: RSA key generation),
+    /// and will otherwise complete the command as usual. Unlike the cancel
+    /// flag, the request is automatically cleared once the command completes.
+    pub fn cancel(&self) {
+        self.requested.store(true, Ordering::Relaxed);
+    }
+
+    pub(crate) fn is_requested(&self) -> bool {
+        self.requested.load(Ordering::Relaxed)
+    }
+
+    pub(crate) fn clear(&self) {
+        self.requested.store(false, Ordering::Relaxed);
+    }
+}
+
 impl MsTpm20RefPlatformImpl {
     fn is_canceled(&self) -> bool {
-        self.state.cancel.flag
+        self.state.cancel.flag || self.cancel_handle.is_requested()
     }
 
     pub fn set_cancel(&mut self) {
@@ -29,24 +77,34 @@ impl MsTpm20RefPlatformImpl {
 
     pub fn clear_cancel(&mut self) {
         self.state.cancel.flag = false;
+        self.cancel_handle.clear();
     }
 }
 
 mod c_api {
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__IsCanceled() -> i32 {
         platform!().is_canceled() as i32
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__SetCancel() {
         platform!().set_cancel()
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__ClearCancel() {
         platform!().clear_cancel()
     }
@@ -56,11 +56,32 @@ impl MsTpm20RefPlatformImpl {
     pub fn timer_reset(&mut self) {
         self.state.clock = ClockState::new();
     }
+
+    /// When the coarse clock is enabled, sample the monotonic timer once ahead
+    /// of a command, and serve all timer reads during the command from it.
+    pub(crate) fn clock_begin_command(&mut self) {
+        if self.coarse_clock {
+            self.clock_sample = Some(self.callbacks.get().monotonic_timer().as_millis());
+        }
+    }
+
+    pub(crate) fn clock_end_command(&mut self) {
+        self.clock_sample = None;
+    }
+
+    fn monotonic_millis(&mut self) -> u128 {
+        match self.clock_sample {
+            Some(now) => now,
+            None => self.callbacks.get().monotonic_timer().as_millis(),
+        }
+    }
 }
 
 impl MsTpm20RefPlatformImpl {
     // Ported over from ms-tps-20-re/TPMCmd/Platform/src/Clock.c
     fn timer_read(&mut self) -> u64 {
+        let now = self.monotonic_millis();
+
         let ClockState {
             adjust_rate,
             last_system_time,
@@ -70,8 +91,6 @@ impl MsTpm20RefPlatformImpl {
             ..
         } = &mut self.state.clock;
 
-        let now = self.callbacks.monotonic_timer().as_millis();
-
         if *last_system_time == 0 {
             *last_system_time = now;
             *last_reported_time = 0;
@@ -100,18 +119,27 @@ impl MsTpm20RefPlatformImpl {
         // Compute the amount of time since the last update of the system clock
         let time_diff = now - *last_real_time;
 
-        // Do the time rate adjustment and conversion from CLOCKS_PER_SEC to mSec
-        let adjusted_time_diff = (time_diff * CLOCK_NOMINAL as u128) / (*adjust_rate as u128);
+        // The rate is only ever adjusted away from nominal via
+        // TPM2_ClockRateAdjust, in which case there's no need for the u128
+        // multiply / divide below (which would be a no-op).
+        let (adjusted_time_diff, readjusted_time_diff) = if *adjust_rate == CLOCK_NOMINAL {
+            (time_diff, time_diff)
+        } else {
+            // Do the time rate adjustment and conversion from CLOCKS_PER_SEC to mSec
+            let adjusted_time_diff = (time_diff * CLOCK_NOMINAL as u128) / (*adjust_rate as u128);
+
+            // Might have some rounding error that would loose CLOCKS. See what is not
+            // being used. As mentioned above, this could result in putting back more than
+            // is taken out. Here, we are trying to recreate timeDiff.
+            let readjusted_time_diff =
+                (adjusted_time_diff * (*adjust_rate as u128)) / CLOCK_NOMINAL as u128;
+
+            (adjusted_time_diff, readjusted_time_diff)
+        };
 
         // update the TPM time with the adjusted timeDiff
         *tpm_time += adjusted_time_diff;
 
-        // Might have some rounding error that would loose CLOCKS. See what is not
-        // being used. As mentioned above, this could result in putting back more than
-        // is taken out. Here, we are trying to recreate timeDiff.
-        let readjusted_time_diff =
-            (adjusted_time_diff * (*adjust_rate as u128)) / CLOCK_NOMINAL as u128;
-
         // adjusted is now converted back to being the amount we should advance the
         // previous sampled time. It should always be less than or equal to timeDiff.
         // That is, we could not have use more time than we started with.
@@ -169,25 +197,37 @@ mod c_api {
     // }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__TimerRead() -> u64 {
         platform!().timer_read()
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__TimerWasReset() -> i32 {
         platform!().timer_was_reset() as i32
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__TimerWasStopped() -> i32 {
         platform!().timer_was_stopped() as i32
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__ClockAdjustRate(adjust: i32) {
         platform!().clock_adjust_rate(adjust)
     }
@@ -3,20 +3,125 @@
 //! Entropy.c
 
 use crate::error::Error;
+use crate::plat::callbacks::Callbacks;
+use crate::plat::metrics::Metrics;
+use crate::EntropyPoolConfig;
 
 use super::super::MsTpm20RefPlatformImpl;
 
+/// Buffered platform entropy, used to batch calls to
+/// [`PlatformCallbacks::get_crypt_random`](crate::PlatformCallbacks::get_crypt_random).
+///
+/// The pool lives outside of `MsTpm20PlatformState`, and is therefore never
+/// included in saved state.
+pub struct EntropyPool {
+    // available entropy, consumed from the back
+    buf: Vec<u8>,
+    low_watermark: usize,
+    high_watermark: usize,
+}
+
+impl EntropyPool {
+    pub fn new(config: EntropyPoolConfig) -> EntropyPool {
+        let high_watermark = config.high_watermark.max(config.low_watermark).max(1);
+        EntropyPool {
+            buf: Vec::with_capacity(high_watermark),
+            low_watermark: config.low_watermark,
+            high_watermark,
+        }
+    }
+
+    /// Top the pool up to its high watermark, or to at least `min` bytes if
+    /// that is larger.
+    fn refill(
+        &mut self,
+        min: usize,
+        callbacks: &mut Callbacks,
+        metrics: Option<&Metrics>,
+    ) -> Result<(), Error> {
+        let target = self.high_watermark.max(min);
+        let mut callbacks = callbacks.get();
+        while self.buf.len() < target {
+            let filled = self.buf.len();
+            self.buf.resize(target, 0);
+            let res = callbacks.get_crypt_random(&mut self.buf[filled..]);
+            let len = match res {
+                Ok(len) => len.min(target - filled),
+                Err(e) => {
+                    self.buf.truncate(filled);
+                    return Err(Error::PlatformCallback(e));
+                }
+            };
+            self.buf.truncate(filled + len);
+            if let Some(metrics) = metrics {
+                metrics.record_entropy(len);
+            }
+            if len == 0 {
+                break;
+            }
+        }
+        Ok(())
+    }
+
+    /// Move up to `out.len()` bytes out of the pool, returning the number of
+    /// bytes written.
+    fn take(&mut self, out: &mut [u8]) -> usize {
+        let len = out.len().min(self.buf.len());
+        let start = self.buf.len() - len;
+        out[..len].copy_from_slice(&self.buf[start..]);
+        // don't leave consumed entropy lying around in spare capacity
+        self.buf[start..].fill(0);
+        self.buf.truncate(start);
+        len
+    }
+}
+
 impl MsTpm20RefPlatformImpl {
     fn get_entropy(&mut self, buf: &mut [u8]) -> Result<usize, Error> {
-        self.callbacks
-            .get_crypt_random(buf)
-            .map_err(Error::PlatformCallback)
+        let pool = match &mut self.entropy_pool {
+            Some(pool) => pool,
+            None => {
+                let len = self
+                    .callbacks
+                    .get()
+                    .get_crypt_random(buf)
+                    .map_err(Error::PlatformCallback)?;
+                if let Some(metrics) = &self.metrics {
+                    metrics.record_entropy(len);
+                }
+                return Ok(len);
+            }
+        };
+
+        if pool.buf.len() < buf.len() {
+            pool.refill(buf.len(), &mut self.callbacks, self.metrics.as_deref())?;
+        }
+        Ok(pool.take(buf))
+    }
+
+    /// Refill the entropy pool (if any) if it has dropped below its low
+    /// watermark. Called between commands, so that the TPM library's requests
+    /// can typically be served from memory.
+    pub(crate) fn entropy_pool_maintain(&mut self) {
+        let pool = match &mut self.entropy_pool {
+            Some(pool) if pool.buf.len() < pool.low_watermark => pool,
+            _ => return,
+        };
+
+        if let Err(e) = pool.refill(0, &mut self.callbacks, self.metrics.as_deref()) {
+            // not fatal: the next request for entropy will retry the refill,
+            // and report the error to the TPM library if it persists.
+            tracing::warn!("failed to refill entropy pool: {}", e);
+        }
     }
 }
 
 mod c_api {
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__GetEntropy(entropy: *mut u8, amount: u32) -> i32 {
         assert!(!entropy.is_null());
 
@@ -38,13 +38,19 @@ impl MsTpm20RefPlatformImpl {
 
 mod c_api {
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__LocalityGet() -> u8 {
         platform!().locality_get()
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__LocalitySet(locality: u8) {
         platform!().locality_set(locality)
     }
@@ -2,6 +2,11 @@
 
 //! NVMem.c
 
+use std::borrow::Cow;
+use std::ops::Deref;
+use std::ops::DerefMut;
+use std::ops::Range;
+
 use serde::Deserialize;
 use serde::Serialize;
 
@@ -9,20 +14,123 @@ use crate::error::Error;
 
 use super::super::MsTpm20RefPlatformImpl;
 
-const NV_MEMORY_SIZE: usize = 0x8000;
+pub const NV_MEMORY_SIZE: usize = 0x8000;
 
 #[derive(Clone, Serialize, Deserialize)]
 pub struct NvState {
-    pub region: Vec<u8>,
+    pub region: NvRegion,
     pub is_init: bool,
+    // not part of the saved state, as there's no telling what the platform
+    // has persisted in the meantime.
+    #[serde(skip)]
+    pub dirty: DirtyRanges,
 }
 
 impl NvState {
     pub fn new() -> NvState {
         NvState {
-            region: Vec::new(),
+            region: NvRegion::Owned(Vec::new()),
             is_init: false,
+            dirty: DirtyRanges::default(),
+        }
+    }
+}
+
+/// Backing memory for the NV region.
+pub enum NvRegion {
+    Owned(Vec<u8>),
+    /// Caller-provided memory (e.g: a memory-mapped file), which is read and
+    /// written in-place.
+    Borrowed(&'static mut [u8]),
+}
+
+impl Deref for NvRegion {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            NvRegion::Owned(region) => region,
+            NvRegion::Borrowed(region) => region,
+        }
+    }
+}
+
+impl DerefMut for NvRegion {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        match self {
+            NvRegion::Owned(region) => region,
+            NvRegion::Borrowed(region) => region,
+        }
+    }
+}
+
+impl Clone for NvRegion {
+    fn clone(&self) -> NvRegion {
+        NvRegion::Owned(self.to_vec())
+    }
+}
+
+// uses the same representation as a `Vec<u8>`, in order to remain compatible
+// with existing saved states
+impl Serialize for NvRegion {
+    fn serialize<S: serde::Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        self.deref().serialize(serializer)
+    }
+}
+
+impl<'de> Deserialize<'de> for NvRegion {
+    fn deserialize<D: serde::Deserializer<'de>>(deserializer: D) -> Result<NvRegion, D::Error> {
+        Vec::deserialize(deserializer).map(NvRegion::Owned)
+    }
+}
+
+/// Byte ranges of the NV region which have been modified since the last
+/// successful commit.
+///
+/// Ranges are kept sorted, and overlapping / adjacent ranges are coalesced.
+#[derive(Clone, Default)]
+pub struct DirtyRanges {
+    ranges: Vec<Range<usize>>,
+}
+
+impl DirtyRanges {
+    /// Mark `range` as dirty, coalescing it with any overlapping or adjacent
+    /// ranges.
+    pub fn mark(&mut self, range: Range<usize>) {
+        if range.is_empty() {
+            return;
         }
+
+        // first range which overlaps / touches the new range
+        let first = self.ranges.partition_point(|r| r.end < range.start);
+        // one past the last range which overlaps / touches the new range
+        let last = first + self.ranges[first..].partition_point(|r| r.start <= range.end);
+
+        let merged = if first == last {
+            range
+        } else {
+            self.ranges[first].start.min(range.start)..self.ranges[last - 1].end.max(range.end)
+        };
+
+        self.ranges.splice(first..last, [merged]);
+    }
+
+    pub fn merge(&mut self, other: &DirtyRanges) {
+        for range in &other.ranges {
+            self.mark(range.clone())
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.ranges.clear()
+    }
+
+    /// Return the `(offset, data)` pairs corresponding to each dirty range.
+    pub fn slices<'a>(&self, region: &'a [u8]) -> Vec<(usize, &'a [u8])> {
+        self.ranges
+            .iter()
+            .map(|r| (r.start, &region[r.clone()]))
+            .collect()
     }
 }
 
@@ -47,7 +155,12 @@ enum NvAvailability {
 }
 
 impl MsTpm20RefPlatformImpl {
-    pub fn nv_enable_from_blob(&mut self, blob: &[u8]) -> Result<(), Error> {
+    /// Load the NV region from an existing blob.
+    ///
+    /// If the platform is using a caller-provided NV region, the blob is
+    /// copied into said region. Otherwise, owned blobs are used as-is, without
+    /// copying.
+    pub fn nv_enable_from_blob(&mut self, blob: Cow<'_, [u8]>) -> Result<(), Error> {
         if self.state.nvmem.is_init {
             return Err(NvError::AlreadyInitialized.into());
         }
@@ -56,8 +169,78 @@ impl MsTpm20RefPlatformImpl {
             return Err(NvError::MismatchedBlobSize.into());
         }
 
-        self.state.nvmem.region = blob.to_vec();
+        match &mut self.state.nvmem.region {
+            NvRegion::Borrowed(region) => {
+                if region.len() != blob.len() {
+                    return Err(NvError::MismatchedBlobSize.into());
+                }
+                region.copy_from_slice(&blob)
+            }
+            NvRegion::Owned(_) => self.state.nvmem.region = NvRegion::Owned(blob.into_owned()),
+        }
         self.state.nvmem.is_init = true;
+        // the blob came from the platform, so it's already persisted
+        self.state.nvmem.dirty.clear();
+
+        Ok(())
+    }
+
+    /// Load the NV region from an [`InstanceTemplate`](crate::InstanceTemplate).
+    ///
+    /// Unlike a blob passed to `nv_enable_from_blob`, the template has never
+    /// been persisted by the platform.
+    pub fn nv_enable_from_template(&mut self, template: &[u8]) -> Result<(), Error> {
+        self.nv_enable_from_blob(Cow::Borrowed(template))?;
+        self.nv_mark_all_dirty();
+        Ok(())
+    }
+
+    /// Use a caller-provided region as the NV region, reading and writing it
+    /// in-place.
+    ///
+    /// The region must be exactly `NV_MEMORY_SIZE` bytes, as that's the size
+    /// of NV the TPM library assumes it has. If `manufacture` is set, the
+    /// region is zeroed in preparation for TPM_Manufacture. Otherwise, the
+    /// region is expected to contain an existing NV blob.
+    pub fn nv_enable_from_region(
+        &mut self,
+        region: &'static mut [u8],
+        manufacture: bool,
+    ) -> Result<(), Error> {
+        if self.state.nvmem.is_init {
+            return Err(NvError::AlreadyInitialized.into());
+        }
+
+        if region.len() != NV_MEMORY_SIZE {
+            return Err(NvError::MismatchedBlobSize.into());
+        }
+
+        self.state.nvmem.region = NvRegion::Borrowed(region);
+        self.state.nvmem.is_init = true;
+
+        if manufacture {
+            self.state.nvmem.region.fill(0);
+            self.nv_mark_all_dirty();
+        } else {
+            // the region came from the platform, so it's already persisted
+            self.state.nvmem.dirty.clear();
+        }
+
+        Ok(())
+    }
+
+    /// Take ownership of a restored NV state.
+    ///
+    /// If the platform is using a caller-provided NV region, the restored
+    /// contents are copied into said region, which remains in use.
+    pub fn nv_restore(&mut self, restored: &mut NvState) -> Result<(), Error> {
+        if let NvRegion::Borrowed(region) = &mut self.state.nvmem.region {
+            if region.len() != restored.region.len() {
+                return Err(NvError::MismatchedBlobSize.into());
+            }
+            region.copy_from_slice(&restored.region);
+            std::mem::swap(&mut self.state.nvmem.region, &mut restored.region);
+        }
 
         Ok(())
     }
@@ -66,9 +249,16 @@ impl MsTpm20RefPlatformImpl {
 impl MsTpm20RefPlatformImpl {
     pub fn nv_enable(&mut self) -> Result<(), Error> {
         if !self.state.nvmem.is_init {
+            if let NvRegion::Borrowed(_) = self.state.nvmem.region {
+                // caller-provided regions _are_ the persistent state
+                self.state.nvmem.is_init = true;
+                return Ok(());
+            }
+
             tracing::debug!("calling __plat_NvEnable before `nv_enable_from_blob` was called");
-            self.state.nvmem.region = vec![0; NV_MEMORY_SIZE];
+            self.state.nvmem.region = NvRegion::Owned(vec![0; NV_MEMORY_SIZE]);
             self.state.nvmem.is_init = true;
+            self.nv_mark_all_dirty();
         }
 
         Ok(())
@@ -80,6 +270,14 @@ impl MsTpm20RefPlatformImpl {
         self.state.nvmem.is_init = false;
     }
 
+    /// Mark the entire NV region as needing to be committed, e.g: after the
+    /// region was replaced wholesale.
+    pub fn nv_mark_all_dirty(&mut self) {
+        let len = self.state.nvmem.region.len();
+        self.state.nvmem.dirty.clear();
+        self.state.nvmem.dirty.mark(0..len);
+    }
+
     fn is_nv_available(&mut self) -> NvAvailability {
         NvAvailability::Available
     }
@@ -141,6 +339,11 @@ impl MsTpm20RefPlatformImpl {
             }
         }
 
+        self.state
+            .nvmem
+            .dirty
+            .mark(start_offset..(start_offset + buf.len()));
+
         Ok(())
     }
 
@@ -156,6 +359,8 @@ impl MsTpm20RefPlatformImpl {
             }
         }
 
+        self.state.nvmem.dirty.mark(start..(start + size));
+
         Ok(())
     }
 
@@ -165,7 +370,9 @@ impl MsTpm20RefPlatformImpl {
         dest_offset: usize,
         size: usize,
     ) -> Result<(), Error> {
-        if source_offset + size > self.state.nvmem.region.len() {
+        if source_offset + size > self.state.nvmem.region.len()
+            || dest_offset + size > self.state.nvmem.region.len()
+        {
             return Err(NvError::InvalidAccess {
                 start_offset: source_offset,
                 len: size,
@@ -178,13 +385,44 @@ impl MsTpm20RefPlatformImpl {
             .region
             .copy_within(source_offset..(source_offset + size), dest_offset);
 
+        self.state
+            .nvmem
+            .dirty
+            .mark(dest_offset..(dest_offset + size));
+
         Ok(())
     }
 
     fn nv_commit(&mut self) -> Result<(), Error> {
-        self.callbacks
-            .commit_nv_state(&self.state.nvmem.region)
-            .map_err(Error::PlatformCallback)
+        if let Some(metrics) = &self.metrics {
+            metrics.record_nv_commit();
+        }
+
+        let nvmem = &self.state.nvmem;
+
+        match &self.nv_scheduler {
+            Some(scheduler) => scheduler.stage(&nvmem.region, &nvmem.dirty)?,
+            None => self
+                .callbacks
+                .get()
+                .commit_nv_delta(&nvmem.region, &nvmem.dirty.slices(&nvmem.region))
+                .map_err(Error::PlatformCallback)?,
+        }
+
+        // only forget about dirty ranges once they've been successfully
+        // committed, so that failed commits can be retried.
+        self.state.nvmem.dirty.clear();
+
+        Ok(())
+    }
+
+    /// Synchronously persist any NV commits which have been staged for a
+    /// background commit.
+    pub fn nv_flush(&mut self) -> Result<(), Error> {
+        match &self.nv_scheduler {
+            Some(scheduler) => scheduler.flush(),
+            None => Ok(()),
+        }
     }
 }
 
@@ -204,7 +442,10 @@ mod c_api {
     // }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NVEnable(plat_parameter: *mut c_void) -> i32 {
         match platform!().nv_enable() {
             Ok(()) => 0,
@@ -216,20 +457,29 @@ mod c_api {
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NVDisable(delete: i32) {
         platform!().nv_disable(delete != 0)
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__IsNvAvailable() -> i32 {
         platform!().is_nv_available() as i32
     }
 
     // NOTE: Why doesn't NvMemoryRead return a bool like NvMemoryWrite??
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NvMemoryRead(start_offset: u32, size: u32, data: *mut c_void) {
         assert!(!data.is_null());
 
@@ -251,7 +501,10 @@ mod c_api {
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NvIsDifferent(
         start_offset: u32,
         size: u32,
@@ -279,7 +532,10 @@ mod c_api {
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NvMemoryWrite(
         start_offset: u32,
         size: u32,
@@ -307,7 +563,10 @@ mod c_api {
 
     // NOTE: Why doesn't NvMemoryClear return a bool??
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NvMemoryClear(start: u32, size: u32) {
         match platform!().nv_memory_clear(start as usize, size as usize) {
             Ok(()) => {}
@@ -324,7 +583,10 @@ mod c_api {
 
     // NOTE: Why doesn't NvMemoryClear return a bool??
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NvMemoryMove(source_offset: u32, dest_offset: u32, size: u32) {
         match platform!().nv_memory_move(
             source_offset as usize,
@@ -345,7 +607,10 @@ mod c_api {
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__NvCommit() -> i32 {
         match platform!().nv_commit() {
             Ok(()) => 0,
@@ -357,8 +622,67 @@ mod c_api {
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace", ret)]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace", ret)
+    )]
     pub unsafe extern "C" fn _plat__GetNvSize() -> u32 {
         super::NV_MEMORY_SIZE as u32
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn dirty(ranges: &[Range<usize>]) -> DirtyRanges {
+        let mut dirty = DirtyRanges::default();
+        for range in ranges {
+            dirty.mark(range.clone());
+        }
+        dirty
+    }
+
+    #[test]
+    fn mark_keeps_ranges_sorted() {
+        assert_eq!(
+            dirty(&[10..20, 0..5, 30..40]).ranges,
+            [0..5, 10..20, 30..40]
+        );
+    }
+
+    #[test]
+    fn mark_coalesces() {
+        // adjacent on either side
+        assert_eq!(dirty(&[0..5, 5..10]).ranges, [0..10]);
+        assert_eq!(dirty(&[5..10, 0..5]).ranges, [0..10]);
+        // bridging and swallowing several ranges
+        assert_eq!(dirty(&[0..5, 10..15, 20..25, 3..22]).ranges, [0..25]);
+        assert_eq!(dirty(&[10..15, 20..25, 0..100]).ranges, [0..100]);
+        // contained in an existing range
+        assert_eq!(dirty(&[0..100, 10..20]).ranges, [0..100]);
+    }
+
+    #[test]
+    fn mark_ignores_empty_ranges() {
+        assert!(dirty(&[5..5]).ranges.is_empty());
+        assert_eq!(dirty(&[0..5, 10..10]).ranges, [0..5]);
+    }
+
+    #[test]
+    fn merge() {
+        let mut a = dirty(&[0..5, 50..60]);
+        a.merge(&dirty(&[5..8, 55..70, 100..110]));
+        assert_eq!(a.ranges, [0..8, 50..70, 100..110]);
+    }
+
+    #[test]
+    fn slices() {
+        let region = (0..32).collect::<Vec<u8>>();
+        let dirty = dirty(&[2..4, 30..32]);
+        assert_eq!(
+            dirty.slices(&region),
+            [(2, &region[2..4]), (30, &region[30..32])]
+        );
+    }
+}
@@ -53,7 +53,10 @@ impl MsTpm20RefPlatformImpl {
 
 mod c_api {
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__Signal_PowerOn() -> i32 {
         match platform!().signal_power_on() {
             Ok(()) => 0,
@@ -65,13 +68,19 @@ mod c_api {
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__WasPowerLost() -> i32 {
         platform!().was_power_lost() as i32
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__Signal_Reset() -> i32 {
         let ret = match platform!().signal_reset() {
             Ok(()) => 0,
@@ -81,7 +90,8 @@ mod c_api {
             }
         };
 
-        // Must call _TPM_Init outside of the platform context to avoid deadlock
+        // Must call _TPM_Init outside of the platform context, as the platform
+        // is not reentrant
         //
         // SAFETY: _TPM_Init has no documented preconditions
         unsafe { crate::plat::ffi::_TPM_Init() };
@@ -90,7 +100,10 @@ mod c_api {
     }
 
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__Signal_PowerOff() {
         platform!().signal_power_off()
     }
@@ -10,7 +10,7 @@ impl MsTpm20RefPlatformImpl {
 
         tracing::debug!("fetching first {} unique value bytes", buf.len());
 
-        let unique = self.callbacks.get_unique_value();
+        let unique = self.callbacks.get().get_unique_value();
 
         let n = buf.len().min(unique.len());
         buf[..n].copy_from_slice(&unique[..n]);
@@ -20,7 +20,10 @@ impl MsTpm20RefPlatformImpl {
 
 mod c_api {
     #[no_mangle]
-    #[tracing::instrument(level = "trace")]
+    #[cfg_attr(
+        not(feature = "no-callback-tracing"),
+        tracing::instrument(level = "trace")
+    )]
     pub unsafe extern "C" fn _plat__GetUnique(which: u32, b_size: u32, b: *mut u8) -> u32 {
         assert!(!b.is_null());
 
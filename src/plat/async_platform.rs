@@ -0,0 +1,235 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Async-friendly wrapper around [`MsTpm20RefPlatform`], which executes
+//! commands on a dedicated thread.
+
+use std::future::Future;
+use std::pin::Pin;
+use std::sync::mpsc;
+use std::sync::Arc;
+use std::sync::Mutex;
+use std::task::Context;
+use std::task::Poll;
+use std::task::Waker;
+use std::thread;
+
+use super::CancelHandle;
+use super::MsTpm20RefPlatform;
+use crate::error::Error;
+
+type Job = Box<dyn FnOnce(&mut MsTpm20RefPlatform) + Send>;
+
+/// A handle to a TPM instance running on its own dedicated thread.
+///
+/// Slow commands (e.g: RSA key generation) can take seconds to complete, and
+/// [`MsTpm20RefPlatform`] blocks the calling thread for their entire duration.
+/// `AsyncMsTpm20RefPlatform` instead moves the instance onto a dedicated
+/// thread, with each operation returning a [`PlatformFuture`] which resolves
+/// once the operation has completed. Any number of async tasks (or threads)
+/// can share a single handle, with operations being executed in the order they
+/// were submitted.
+///
+/// The returned futures are executor-agnostic, and the engine thread itself
+/// never blocks on anything but the TPM library and its callbacks. Each
+/// instance gets its own thread, though calls into the TPM library are still
+/// serialized across all instances in the process (see
+/// [`MsTpm20RefPlatform`]).
+///
+/// When `AsyncMsTpm20RefPlatform` is dropped, any operations which have
+/// already been submitted are run to completion, after which the instance is
+/// uninitialized and the engine thread is joined.
+#[derive(Debug)]
+pub struct AsyncMsTpm20RefPlatform {
+    jobs: Option<mpsc::Sender<Job>>,
+    thread: Option<thread::JoinHandle<()>>,
+    cancel_handle: CancelHandle,
+}
+
+impl AsyncMsTpm20RefPlatform {
+    pub(crate) fn new(platform: MsTpm20RefPlatform) -> Result<AsyncMsTpm20RefPlatform, Error> {
+        let cancel_handle = platform.cancel_handle();
+        let (jobs, rx) = mpsc::channel::<Job>();
+
+        let thread = thread::Builder::new()
+            .name("ms-tpm-20-ref".into())
+            .spawn(move || {
+                let mut platform = platform;
+                for job in rx {
+                    job(&mut platform);
+                }
+            })
+            .map_err(Error::EngineThread)?;
+
+        Ok(AsyncMsTpm20RefPlatform {
+            jobs: Some(jobs),
+            thread: Some(thread),
+            cancel_handle,
+        })
+    }
+
+    /// Run `f` against the instance on the engine thread, returning a future
+    /// which resolves to its result.
+    ///
+    /// If the returned future is dropped before `f` has started running, `f`
+    /// is skipped altogether. Dropping the future does _not_ abort `f` if it
+    /// has already started: use [`cancel_handle`](Self::cancel_handle) to
+    /// abort an in-flight command.
+    pub fn run<F, R>(&self, f: F) -> PlatformFuture<R>
+    where
+        F: FnOnce(&mut MsTpm20RefPlatform) -> R + Send + 'static,
+        R: Send + 'static,
+    {
+        let slot = Arc::new(Mutex::new(Slot::Pending(None)));
+        let completion = Completion(slot.clone());
+
+        // if the engine thread has exited, the job is dropped along with its
+        // completion, which in turn resolves the future.
+        let _ = self
+            .jobs
+            .as_ref()
+            .expect("engine thread is running")
+            .send(Box::new(move |platform| completion.run(|| f(platform))));
+
+        PlatformFuture { slot }
+    }
+
+    /// Execute a command on the TPM, resolving to the response (truncated to
+    /// the size of the response written by the TPM).
+    ///
+    /// See [`MsTpm20RefPlatform::execute_command`].
+    pub fn execute_command(
+        &self,
+        mut request: Vec<u8>,
+        mut response: Vec<u8>,
+    ) -> PlatformFuture<Result<Vec<u8>, Error>> {
+        self.run(move |platform| {
+            let response_len = platform.execute_command(&mut request, &mut response)?;
+            response.truncate(response_len);
+            Ok(response)
+        })
+    }
+
+    /// Return a handle which can be used to abort the command currently being
+    /// executed by the instance, without waiting for it to complete.
+    ///
+    /// See [`CancelHandle::cancel`] for details.
+    pub fn cancel_handle(&self) -> CancelHandle {
+        self.cancel_handle.clone()
+    }
+}
+
+impl Drop for AsyncMsTpm20RefPlatform {
+    fn drop(&mut self) {
+        // disconnect the channel, letting the engine thread exit once it's
+        // done with any outstanding jobs.
+        drop(self.jobs.take());
+
+        if let Some(thread) = self.thread.take() {
+            // a job may have ended up holding the last reference to its own
+            // handle, in which case the engine thread exits on its own.
+            if thread.thread().id() != thread::current().id() {
+                // if the engine thread panicked, any pending futures have
+                // already been resolved.
+                let _ = thread.join();
+            }
+        }
+    }
+}
+
+enum Slot<R> {
+    // waiting on the engine thread, with the waker of the most recent poll
+    Pending(Option<Waker>),
+    Ready(R),
+    // result has been returned from `poll`
+    Taken,
+    // future was dropped before the job completed
+    Abandoned,
+    // job was dropped without being run (i.e: the engine thread panicked)
+    Disconnected,
+}
+
+/// Engine-thread side of a [`PlatformFuture`].
+struct Completion<R>(Arc<Mutex<Slot<R>>>);
+
+impl<R> Completion<R> {
+    fn run(self, f: impl FnOnce() -> R) {
+        if matches!(*self.0.lock().unwrap(), Slot::Abandoned) {
+            return;
+        }
+
+        let out = f();
+
+        let mut slot = self.0.lock().unwrap();
+        if let Slot::Pending(waker) = &mut *slot {
+            let waker = waker.take();
+            *slot = Slot::Ready(out);
+            drop(slot);
+            if let Some(waker) = waker {
+                waker.wake();
+            }
+        }
+    }
+}
+
+impl<R> Drop for Completion<R> {
+    fn drop(&mut self) {
+        let mut slot = self.0.lock().unwrap();
+        if let Slot::Pending(waker) = &mut *slot {
+            let waker = waker.take();
+            *slot = Slot::Disconnected;
+            drop(slot);
+            if let Some(waker) = waker {
+                waker.wake();
+            }
+        }
+    }
+}
+
+/// A future resolving to the result of an operation submitted to an
+/// [`AsyncMsTpm20RefPlatform`].
+///
+/// # Panics
+///
+/// Polling panics if the engine thread panicked before completing the
+/// operation.
+#[must_use = "futures do nothing unless polled, and dropping a PlatformFuture may skip its operation"]
+pub struct PlatformFuture<R> {
+    slot: Arc<Mutex<Slot<R>>>,
+}
+
+impl<R> std::fmt::Debug for PlatformFuture<R> {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("PlatformFuture").finish_non_exhaustive()
+    }
+}
+
+impl<R> Future for PlatformFuture<R> {
+    type Output = R;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<R> {
+        let mut slot = self.slot.lock().unwrap();
+        match std::mem::replace(&mut *slot, Slot::Taken) {
+            Slot::Ready(out) => Poll::Ready(out),
+            Slot::Pending(waker) => {
+                let waker = match waker {
+                    Some(waker) if waker.will_wake(cx.waker()) => waker,
+                    _ => cx.waker().clone(),
+                };
+                *slot = Slot::Pending(Some(waker));
+                Poll::Pending
+            }
+            Slot::Disconnected => panic!("TPM engine thread panicked"),
+            Slot::Taken => panic!("PlatformFuture polled after completion"),
+            Slot::Abandoned => unreachable!("future is still live"),
+        }
+    }
+}
+
+impl<R> Drop for PlatformFuture<R> {
+    fn drop(&mut self) {
+        let mut slot = self.slot.lock().unwrap();
+        if matches!(*slot, Slot::Pending(_)) {
+            *slot = Slot::Abandoned;
+        }
+    }
+}
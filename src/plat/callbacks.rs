@@ -0,0 +1,88 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Storage for the user-provided [`PlatformCallbacks`].
+
+use std::ops::Deref;
+use std::ops::DerefMut;
+use std::sync::Arc;
+use std::sync::Mutex;
+use std::sync::MutexGuard;
+use std::time::Instant;
+
+use super::metrics::Metrics;
+use crate::PlatformCallbacks;
+
+pub type BoxedCallbacks = Box<dyn PlatformCallbacks + Send>;
+
+/// Platform callbacks are typically exclusively owned by the platform, and are
+/// only ever invoked from the thread calling into the TPM library.
+///
+/// Certain features (e.g: background NV commits) require invoking callbacks
+/// from other threads, in which case the callbacks are shared behind a mutex.
+pub enum CallbacksKind {
+    Owned(BoxedCallbacks),
+    Shared(Arc<Mutex<BoxedCallbacks>>),
+}
+
+pub struct Callbacks {
+    kind: CallbacksKind,
+    // if set, time spent in callbacks is recorded here
+    metrics: Option<Arc<Metrics>>,
+}
+
+impl Callbacks {
+    pub fn new(kind: CallbacksKind, metrics: Option<Arc<Metrics>>) -> Callbacks {
+        Callbacks { kind, metrics }
+    }
+
+    pub fn get(&mut self) -> CallbacksGuard<'_> {
+        let inner = match &mut self.kind {
+            CallbacksKind::Owned(callbacks) => GuardKind::Owned(callbacks),
+            CallbacksKind::Shared(callbacks) => GuardKind::Shared(callbacks.lock().unwrap()),
+        };
+        CallbacksGuard {
+            inner,
+            timing: self.metrics.as_deref().map(|m| (m, Instant::now())),
+        }
+    }
+}
+
+enum GuardKind<'a> {
+    Owned(&'a mut BoxedCallbacks),
+    Shared(MutexGuard<'a, BoxedCallbacks>),
+}
+
+/// Access to the platform callbacks. When metrics are enabled, the time the
+/// guard is held for is accounted as callback time.
+pub struct CallbacksGuard<'a> {
+    inner: GuardKind<'a>,
+    timing: Option<(&'a Metrics, Instant)>,
+}
+
+impl Drop for CallbacksGuard<'_> {
+    fn drop(&mut self) {
+        if let Some((metrics, start)) = self.timing {
+            metrics.record_callback(start.elapsed());
+        }
+    }
+}
+
+impl Deref for CallbacksGuard<'_> {
+    type Target = dyn PlatformCallbacks + Send;
+
+    fn deref(&self) -> &Self::Target {
+        match &self.inner {
+            GuardKind::Owned(callbacks) => &***callbacks,
+            GuardKind::Shared(callbacks) => &***callbacks,
+        }
+    }
+}
+
+impl DerefMut for CallbacksGuard<'_> {
+    fn deref_mut(&mut self) -> &mut Self::Target {
+        match &mut self.inner {
+            GuardKind::Owned(callbacks) => &mut ***callbacks,
+            GuardKind::Shared(callbacks) => &mut ***callbacks,
+        }
+    }
+}
@@ -0,0 +1,153 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Lock-free collection of platform metrics, enabled via
+//! [`PlatformConfig::metrics`](crate::PlatformConfig::metrics).
+
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering;
+use std::time::Duration;
+
+/// Number of buckets in each [`CommandStats::histogram`].
+pub const HISTOGRAM_BUCKETS: usize = 24;
+
+// TPM_CC_FIRST. Command codes in the range `CC_FIRST..CC_FIRST + CC_SLOTS`
+// get their own stats, with everything else (e.g: vendor commands) being
+// lumped together.
+const CC_FIRST: u32 = 0x11f;
+const CC_SLOTS: usize = 0x80;
+
+#[derive(Default)]
+struct CommandCounters {
+    count: AtomicU64,
+    total_ns: AtomicU64,
+    histogram: [AtomicU64; HISTOGRAM_BUCKETS],
+}
+
+impl CommandCounters {
+    fn record(&self, elapsed: Duration) {
+        let micros = elapsed.as_micros().min(u64::MAX as u128) as u64;
+        let bucket = ((u64::BITS - micros.leading_zeros()) as usize)
+            .saturating_sub(1)
+            .min(HISTOGRAM_BUCKETS - 1);
+
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.total_ns
+            .fetch_add(elapsed.as_nanos() as u64, Ordering::Relaxed);
+        self.histogram[bucket].fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn snapshot(&self) -> CommandStats {
+        CommandStats {
+            count: self.count.load(Ordering::Relaxed),
+            total_time: Duration::from_nanos(self.total_ns.load(Ordering::Relaxed)),
+            histogram: std::array::from_fn(|i| self.histogram[i].load(Ordering::Relaxed)),
+        }
+    }
+}
+
+/// Counters shared between a platform handle, its platform implementation, and
+/// any background threads it owns.
+pub struct Metrics {
+    commands: Box<[CommandCounters]>,
+    other_commands: CommandCounters,
+    nv_commits: AtomicU64,
+    entropy_bytes: AtomicU64,
+    callback_calls: AtomicU64,
+    callback_ns: AtomicU64,
+}
+
+impl std::fmt::Debug for Metrics {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("Metrics").finish_non_exhaustive()
+    }
+}
+
+impl Metrics {
+    pub fn new() -> Metrics {
+        Metrics {
+            commands: (0..CC_SLOTS).map(|_| CommandCounters::default()).collect(),
+            other_commands: CommandCounters::default(),
+            nv_commits: AtomicU64::new(0),
+            entropy_bytes: AtomicU64::new(0),
+            callback_calls: AtomicU64::new(0),
+            callback_ns: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record_command(&self, command_code: u32, elapsed: Duration) {
+        command_code
+            .checked_sub(CC_FIRST)
+            .and_then(|i| self.commands.get(i as usize))
+            .unwrap_or(&self.other_commands)
+            .record(elapsed)
+    }
+
+    pub fn record_nv_commit(&self) {
+        self.nv_commits.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn record_entropy(&self, bytes: usize) {
+        self.entropy_bytes
+            .fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+
+    pub fn record_callback(&self, elapsed: Duration) {
+        self.callback_calls.fetch_add(1, Ordering::Relaxed);
+        self.callback_ns
+            .fetch_add(elapsed.as_nanos() as u64, Ordering::Relaxed);
+    }
+
+    pub fn snapshot(&self) -> PlatformMetrics {
+        PlatformMetrics {
+            commands: (self.commands.iter().enumerate())
+                .map(|(i, counters)| (CC_FIRST + i as u32, counters.snapshot()))
+                .filter(|(_, stats)| stats.count != 0)
+                .collect(),
+            other_commands: self.other_commands.snapshot(),
+            nv_commits: self.nv_commits.load(Ordering::Relaxed),
+            entropy_bytes: self.entropy_bytes.load(Ordering::Relaxed),
+            callback_calls: self.callback_calls.load(Ordering::Relaxed),
+            callback_time: Duration::from_nanos(self.callback_ns.load(Ordering::Relaxed)),
+        }
+    }
+}
+
+/// Execution statistics for a single TPM command code.
+#[derive(Debug, Clone)]
+#[non_exhaustive]
+pub struct CommandStats {
+    /// Number of times the command was executed.
+    pub count: u64,
+    /// Total wall time spent executing the command.
+    pub total_time: Duration,
+    /// Log2 histogram of wall time per execution, in microseconds.
+    ///
+    /// Bucket `0` counts executions which took less than 2us, and bucket
+    /// `n` counts executions which took `2^n..2^(n+1)` us. The last bucket
+    /// also counts any executions which took longer.
+    pub histogram: [u64; HISTOGRAM_BUCKETS],
+}
+
+/// A point-in-time snapshot of the metrics collected by a platform, returned by
+/// [`MsTpm20RefPlatform::metrics`](crate::MsTpm20RefPlatform::metrics).
+///
+/// All counters are cumulative since the platform was initialized.
+#[derive(Debug, Clone)]
+#[non_exhaustive]
+pub struct PlatformMetrics {
+    /// Per-command statistics, as `(TPM_CC, stats)` pairs sorted by command
+    /// code. Commands which have never been executed are omitted.
+    pub commands: Vec<(u32, CommandStats)>,
+    /// Aggregate statistics for commands with codes outside the range defined
+    /// by the TPM 2.0 specification (e.g: vendor commands).
+    pub other_commands: CommandStats,
+    /// Number of NV commits requested by the TPM library.
+    pub nv_commits: u64,
+    /// Number of entropy bytes drawn from the platform callbacks.
+    pub entropy_bytes: u64,
+    /// Number of platform callback invocations.
+    pub callback_calls: u64,
+    /// Total wall time spent in platform callbacks (including NV commits made
+    /// from a background thread).
+    pub callback_time: Duration,
+}
@@ -1,8 +1,16 @@
 // Copyright (C) Microsoft Corporation. All rights reserved.
 
 use core::marker::PhantomData;
+use std::collections::HashMap;
 use std::convert::TryInto;
+use std::ptr;
+#[cfg(debug_assertions)]
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::AtomicPtr;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
 use std::sync::Mutex;
+use std::sync::MutexGuard;
 
 use once_cell::sync::Lazy;
 use serde::Deserialize;
@@ -11,9 +19,26 @@ use serde::Serialize;
 use crate::error::*;
 use crate::tpmlib_state;
 use crate::InitKind;
+use crate::NvCommitPolicy;
 use crate::PlatformCallbacks;
+use crate::PlatformConfig;
 
 pub(crate) mod api;
+mod async_platform;
+mod callbacks;
+mod metrics;
+mod nv_commit;
+mod snapshot;
+mod sparse;
+mod state_stream;
+
+pub use api::cancel::CancelHandle;
+pub use async_platform::AsyncMsTpm20RefPlatform;
+pub use async_platform::PlatformFuture;
+pub use metrics::CommandStats;
+pub use metrics::PlatformMetrics;
+pub use metrics::HISTOGRAM_BUCKETS;
+pub use snapshot::SnapshotId;
 
 // NOTE: Stashing the platform implementation behind a global Mutex is *not*
 // done to enforce serialized access to the platform's various methods. The
@@ -27,20 +52,94 @@ pub(crate) mod api;
 // potentially-deadlocking `.lock()` method is never called on the platform
 // mutex, with `.try_lock()` being used instead.
 //
-// So, why use a mutex at all?
+// The mutex is only used by the Rust side of the wrapper. Platform callbacks
+// invoked by the C library don't touch it: instead, the code calling into the
+// C library holds the lock for the duration of the call, and installs a pointer
+// to the platform in `ACTIVE_PLATFORM` (see `with_active_platform`). This keeps
+// the (very frequently invoked) callbacks down to a plain pointer load.
 //
-// 1. It serves as a good "assert" mechanism to ensure that the underlying C
-// library is indeed single-threaded, and isn't calling platform methods at the
-// same time. The current platform implementation is _not_ reentrant, and if the
-// underlying TPM library ever switches to a multithreaded model, we'd want to
-// fail-fast.
+// In debug builds, callbacks additionally assert that they aren't being invoked
+// reentrantly (or concurrently), which is what the mutex used to check. The
+// current platform implementation is _not_ reentrant, and if the underlying TPM
+// library ever switches to a multithreaded model, we'd want to fail-fast.
 //
-// 2. It's nicer than using a `static mut PLATFORM` + copious `unsafe` blocks to
-// access the global platform. Moreover, this is not supposed to be "high
-// performance" code, so the minor overhead of going through a mutex isn't
-// important.
+// Only the platform of the currently _resident_ instance lives in `PLATFORM`.
+// See `Engine` for details on how multiple instances share the C library.
 static PLATFORM: Lazy<Mutex<Option<MsTpm20RefPlatformImpl>>> = Lazy::new(|| Mutex::new(None));
 
+static ACTIVE_PLATFORM: AtomicPtr<MsTpm20RefPlatformImpl> = AtomicPtr::new(ptr::null_mut());
+
+#[cfg(debug_assertions)]
+static IN_CALLBACK: AtomicBool = AtomicBool::new(false);
+
+/// Call into the C library, with `platform` made available to any platform
+/// callbacks it invokes.
+fn with_active_platform<R>(platform: &mut MsTpm20RefPlatformImpl, f: impl FnOnce() -> R) -> R {
+    struct Uninstall;
+
+    impl Drop for Uninstall {
+        fn drop(&mut self) {
+            ACTIVE_PLATFORM.store(ptr::null_mut(), Ordering::Release);
+        }
+    }
+
+    ACTIVE_PLATFORM.store(platform, Ordering::Release);
+    let _uninstall = Uninstall;
+    f()
+}
+
+/// Access to the platform from within a platform callback. Obtained via the
+/// `platform!()` macro.
+struct ActivePlatform {
+    platform: ptr::NonNull<MsTpm20RefPlatformImpl>,
+}
+
+impl ActivePlatform {
+    fn get() -> ActivePlatform {
+        let platform = ptr::NonNull::new(ACTIVE_PLATFORM.load(Ordering::Acquire))
+            .expect("called platform function outside of a call into the TPM library");
+
+        #[cfg(debug_assertions)]
+        assert!(
+            !IN_CALLBACK.swap(true, Ordering::Acquire),
+            "TPM platform is neither reentrant or multithread capable!"
+        );
+
+        ActivePlatform { platform }
+    }
+}
+
+#[cfg(debug_assertions)]
+impl Drop for ActivePlatform {
+    fn drop(&mut self) {
+        IN_CALLBACK.store(false, Ordering::Release);
+    }
+}
+
+impl core::ops::Deref for ActivePlatform {
+    type Target = MsTpm20RefPlatformImpl;
+
+    fn deref(&self) -> &Self::Target {
+        // SAFETY: `with_active_platform` holds the `PLATFORM` lock (and doesn't
+        // otherwise touch the platform) for as long as the pointer is
+        // installed, and the C library only invokes one callback at a time.
+        unsafe { self.platform.as_ref() }
+    }
+}
+
+impl core::ops::DerefMut for ActivePlatform {
+    fn deref_mut(&mut self) -> &mut Self::Target {
+        // SAFETY: see `Deref` impl
+        unsafe { self.platform.as_mut() }
+    }
+}
+
+// Unlike `PLATFORM`, the engine mutex _is_ used to serialize access: it is held
+// for the entire duration of any call into the C library, and is what allows
+// multiple `MsTpm20RefPlatform` instances to live on different threads. It is
+// never taken from within a platform callback.
+static ENGINE: Lazy<Mutex<Engine>> = Lazy::new(|| Mutex::new(Engine::new()));
+
 // Defined in `RunCommand.c`
 #[link(name = "run_command")]
 extern "C" {
@@ -52,6 +151,52 @@ extern "C" {
     );
 }
 
+// Defined in `overrides/src/crypt/ossl/TpmToOsslSupport.c`,
+// `overrides/src/crypt/ossl/TpmToOsslAesSupport.c` and
+// `overrides/src/crypt/ossl/TpmToOsslMath.c`
+#[link(name = "tpm")]
+extern "C" {
+    fn OsslContextPoolReset();
+    fn OsslAesContextReset();
+    fn OsslMontCacheFlush();
+    fn OsslMontCacheSweep();
+}
+
+/// Drop the expanded AES keys cached by the OpenSSL glue.
+///
+/// Must be called after every call into the C library, so that key material
+/// doesn't outlive the call that used it.
+fn reset_aes_contexts() {
+    // SAFETY: the caller holds the engine lock, and the C library isn't running
+    unsafe { OsslAesContextReset() }
+}
+
+/// Drop everything cached by the OpenSSL glue which may hold key material
+/// belonging to the resident instance.
+fn reset_library_caches() {
+    // SAFETY: the caller holds the engine lock, and the C library isn't running
+    unsafe { OsslContextPoolReset() };
+    reset_aes_contexts();
+    flush_mont_cache();
+}
+
+/// Drop the Montgomery contexts cached by the OpenSSL glue.
+///
+/// Must be called whenever the runtime state of the C library is replaced, as
+/// the cache may hold key material belonging to the previous state.
+fn flush_mont_cache() {
+    // SAFETY: the caller holds the engine lock, and the C library isn't running
+    unsafe { OsslMontCacheFlush() }
+}
+
+// Defined in `overrides/src/instance_template.c`
+#[link(name = "tpm")]
+extern "C" {
+    fn INJECTED_ReseedManufacturedState() -> i32;
+}
+
+const TPM_CC_SHUTDOWN: u32 = 0x145;
+
 // methods defined within ms-tpm-20-ref
 mod ffi {
     extern "C" {
@@ -60,6 +205,34 @@ mod ffi {
     }
 }
 
+/// Prefix of compact saved-state blobs (see
+/// [`PlatformConfig::compact_saved_state`]), followed by a postcard encoded
+/// `(sparse tpmlib_state, platform_state, sparse nv_region)` tuple, where the
+/// NV region within `platform_state` is left empty.
+///
+/// Regular blobs start with the varint encoded size of the C library state,
+/// which is always large enough for the first byte to have its high bit set,
+/// so the two can't be confused.
+const COMPACT_STATE_MAGIC: [u8; 8] = *b"VTPMCMPT";
+
+/// Encode a compact saved-state blob into `out`, replacing its contents.
+/// `platform_state` must have an empty NV region.
+fn encode_compact_state(
+    out: &mut Vec<u8>,
+    tpmlib_state: &[u8],
+    platform_state: &MsTpm20PlatformState,
+    nv_region: &[u8],
+) {
+    out.clear();
+    out.extend_from_slice(&COMPACT_STATE_MAGIC);
+    let compact = (
+        sparse::encode(tpmlib_state),
+        platform_state,
+        sparse::encode(nv_region),
+    );
+    *out = postcard::to_extend(&compact, std::mem::take(out)).expect("failed to serialize state");
+}
+
 /// Serde de/serializable representation of the ms-tpm-20-ref library's runtime
 /// state (both core C library runtime, and Rust platform runtime)
 #[derive(Clone, Serialize, Deserialize)]
@@ -68,23 +241,372 @@ pub struct MsTpm20RefRuntimeState {
     platform_state: MsTpm20PlatformState,
 }
 
-/// A handle which encapsulates the logical ownership of the global platform
-/// singleton.
+/// The ms-tpm-20-ref C library keeps all of its state in process-wide globals,
+/// and can therefore only run a single TPM at a time.
+///
+/// To support multiple live TPM instances within a single process, instances
+/// are time-multiplexed over those globals: the instance that last called into
+/// the C library is "resident" (i.e: its state is what's currently in the C
+/// globals, and its platform is in `PLATFORM`), while every other instance is
+/// "parked", with its C library state stashed away in host memory.
+///
+/// Switching between instances is done by a single pass over the C library's
+/// runtime variables, copying the resident instance's state out into its arena,
+/// and the incoming instance's arena in. Arenas are cache-line aligned, and are
+/// recycled between instances, so switching never allocates.
+struct Engine {
+    next_id: u64,
+    resident: Option<u64>,
+    parked: HashMap<u64, ParkedInstance>,
+    // arena which isn't backing any parked instance, recycled across swaps to
+    // avoid allocating on every instance switch.
+    spare: Option<tpmlib_state::RuntimeArena>,
+    // snapshot of the C library globals prior to any instance being
+    // initialized, used to give each new instance a clean slate.
+    pristine: Option<tpmlib_state::RuntimeArena>,
+}
+
+struct ParkedInstance {
+    platform: MsTpm20RefPlatformImpl,
+    arena: tpmlib_state::RuntimeArena,
+}
+
+impl Engine {
+    fn new() -> Engine {
+        Engine {
+            next_id: 0,
+            resident: None,
+            parked: HashMap::new(),
+            spare: None,
+            pristine: None,
+        }
+    }
+
+    /// Swap out the currently resident instance (if any), replacing the C
+    /// library globals with the contents of `load` (or leaving them in an
+    /// unspecified state, if None).
+    fn swap_out_resident(&mut self, load: Option<&tpmlib_state::RuntimeArena>) {
+        reset_library_caches();
+
+        match self.resident.take() {
+            Some(id) => {
+                let platform = PLATFORM
+                    .try_lock()
+                    .unwrap()
+                    .take()
+                    .expect("resident instance has a platform");
+
+                let mut arena = self
+                    .spare
+                    .take()
+                    .unwrap_or_else(tpmlib_state::RuntimeArena::new);
+                tpmlib_state::swap_runtime_state(Some(&mut arena), load);
+
+                self.parked.insert(id, ParkedInstance { platform, arena });
+            }
+            None => {
+                if load.is_some() {
+                    tpmlib_state::swap_runtime_state(None, load);
+                }
+            }
+        }
+    }
+
+    /// Remove the resident instance without parking it (i.e: because it is
+    /// being dropped), returning its platform.
+    ///
+    /// The C library globals are reset to their pristine state, so that the
+    /// instance's seeds and keys don't linger in them until the next instance
+    /// is initialized.
+    fn remove_resident(&mut self) -> MsTpm20RefPlatformImpl {
+        reset_library_caches();
+
+        let platform = PLATFORM
+            .try_lock()
+            .unwrap()
+            .take()
+            .expect("resident instance has a platform");
+        if let Some(pristine) = &self.pristine {
+            tpmlib_state::swap_runtime_state(None, Some(pristine));
+        }
+        // the spare arena may hold a stale copy of the resident's state
+        if let Some(spare) = &mut self.spare {
+            spare.clear();
+        }
+        self.resident = None;
+        platform
+    }
+
+    /// Swap in the specified instance, parking the currently resident instance
+    /// if required.
+    fn make_resident(&mut self, id: u64) {
+        if self.resident == Some(id) {
+            return;
+        }
+
+        let parked = self.parked.remove(&id).expect("instance is registered");
+        self.swap_out_resident(Some(&parked.arena));
+        *PLATFORM.try_lock().unwrap() = Some(parked.platform);
+        self.resident = Some(id);
+        self.spare = Some(parked.arena);
+    }
+
+    /// Park the currently resident instance, and reset the C library globals
+    /// to the state they were in prior to any instance being initialized.
+    fn make_pristine(&mut self) {
+        match self.pristine.take() {
+            None => {
+                // no instance has ever been initialized, so the globals are
+                // guaranteed to be pristine
+                assert!(self.resident.is_none());
+                let mut pristine = tpmlib_state::RuntimeArena::new();
+                tpmlib_state::swap_runtime_state(Some(&mut pristine), None);
+                self.pristine = Some(pristine);
+            }
+            Some(pristine) => {
+                self.swap_out_resident(Some(&pristine));
+                self.pristine = Some(pristine);
+            }
+        }
+    }
+
+    /// Reset the C library globals of the resident instance to their pristine
+    /// state, returning a backup of the prior state.
+    fn reset_resident_to_pristine(&mut self) -> tpmlib_state::RuntimeArena {
+        flush_mont_cache();
+
+        let mut backup = self
+            .spare
+            .take()
+            .unwrap_or_else(tpmlib_state::RuntimeArena::new);
+        let pristine = self.pristine.as_ref().expect("an instance was initialized");
+        tpmlib_state::swap_runtime_state(Some(&mut backup), Some(pristine));
+        backup
+    }
+
+    /// Restore the C library globals of the resident instance from a backup
+    /// returned by `reset_resident_to_pristine`.
+    fn restore_resident_from(&mut self, backup: tpmlib_state::RuntimeArena) {
+        tpmlib_state::swap_runtime_state(None, Some(&backup));
+        self.spare = Some(backup);
+    }
+}
+
+/// A single command in a batch passed to
+/// [`MsTpm20RefPlatform::execute_commands`].
+#[non_exhaustive]
+#[derive(Debug)]
+pub struct CommandSlot<'a> {
+    /// Buffer containing the command.
+    pub request: &'a mut [u8],
+    /// Buffer the response is written into.
+    pub response: &'a mut [u8],
+    /// Size of the response written into `response`, or why the command could
+    /// not be executed. `None` until the batch has been executed.
+    pub result: Option<Result<usize, Error>>,
+}
+
+impl<'a> CommandSlot<'a> {
+    /// Create a new slot for the given request / response buffers.
+    pub fn new(request: &'a mut [u8], response: &'a mut [u8]) -> CommandSlot<'a> {
+        CommandSlot {
+            request,
+            response,
+            result: None,
+        }
+    }
+}
+
+/// Validate the request header, returning the size of the request it
+/// describes.
+fn checked_request_len(request: &[u8]) -> Result<usize, Error> {
+    let request_header_size = request
+        .get(2..6)
+        .map(|b| u32::from_be_bytes(b.try_into().unwrap()))
+        .ok_or(Error::InvalidRequestSize)?;
+
+    if request_header_size > request.len() as u32 {
+        return Err(Error::InvalidRequestSize);
+    }
+
+    Ok(request_header_size as usize)
+}
+
+/// Run a single command on the resident instance.
+///
+/// # Safety
+///
+/// The caller must hold the `ENGINE` lock with the instance resident, and
+/// ensure that the request and response buffers are appropriately sized for
+/// the respective command.
+unsafe fn run_command(
+    request: &mut [u8],
+    response: &mut [u8],
+    metrics: Option<&metrics::Metrics>,
+) -> usize {
+    let request_size = request.len() as u32;
+    let request_ptr = request.as_mut_ptr();
+    let mut response_size = response.len() as u32;
+    let mut response_ptr = response.as_mut_ptr();
+
+    let prev_response_ptr = response_ptr;
+    let command_code = request
+        .get(6..10)
+        .map(|b| u32::from_be_bytes(b.try_into().unwrap()));
+    let is_shutdown = command_code == Some(TPM_CC_SHUTDOWN);
+    let start = metrics.map(|_| std::time::Instant::now());
+
+    let mut platform = PLATFORM.try_lock().unwrap();
+    let platform = platform.as_mut().expect("platform is initialized");
+
+    platform.clock_begin_command();
+    with_active_platform(platform, || {
+        // SAFETY: The request / response buffers point to valid Rust slices,
+        // the caller holds the engine lock, and OsslContextPoolReset /
+        // OsslAesContextReset / OsslMontCacheSweep are called between commands.
+        unsafe {
+            RunCommand(
+                request_size,
+                request_ptr,
+                &mut response_size,
+                &mut response_ptr,
+            );
+            // don't keep the bignums used by the command around (which may
+            // include key material), nor any BN_CTX frames left dangling by a
+            // command aborted via _plat__Fail.
+            OsslContextPoolReset();
+            // don't keep expanded AES keys around past the command that used them
+            OsslAesContextReset();
+            // nor the primes of RSA keys which the command flushed or evicted
+            OsslMontCacheSweep();
+        }
+    });
+
+    // requests made via a `CancelHandle` only apply to a single command
+    platform.cancel_handle.clear();
+
+    if let (Some(metrics), Some(start), Some(command_code)) = (metrics, start, command_code) {
+        metrics.record_command(command_code, start.elapsed());
+    }
+
+    // NOTE: the API of the underlying C library makes it possible for the
+    // underlying C library to modify the response pointer to point to a
+    // different buffer than the one passed in.
+    //
+    // The common use case is to return a pointer to a global static buffer
+    // when the TPM enters a failure mode. This is pretty easy to handle, as
+    // we can simply copy data from said buffer into the response buffer
+    // prior to returning from the function.
+    //
+    // That said, we do need to be careful against the possible case of the
+    // C library returning a response pointer that points into the provided
+    // request buffer. In that case, naively using
+    // `slice::from_raw_parts_mut` would result in UB, as it would result in
+    // two mutable Rust slices which alias the same memory location.
+    //
+    // This doesn't happen in the current version of the library, but we
+    // double-check and handle this edge-case regardless.
+    if prev_response_ptr != response_ptr {
+        if response_ptr == request_ptr {
+            panic!("TPM library unexpectedly returned a response in request buffer");
+        }
+
+        if response_ptr.is_null() {
+            panic!("TPM library set response pointer to null");
+        }
+
+        tracing::warn!("TPM library returned a response ptr that doesn't match the provided response buffer: {:#x?} != {:#x?}", prev_response_ptr, response_ptr);
+
+        // copy response from library provided response buffer into user response buffer
+        //
+        // SAFETY: C library is returning a valid, albeit different, pointer.
+        let c_response =
+            unsafe { core::slice::from_raw_parts_mut(response_ptr, response_size as usize) };
+        response[..response_size as usize].copy_from_slice(c_response);
+    }
+
+    // the TPM is expected to be durable across an orderly shutdown
+    if is_shutdown {
+        if let Err(e) = platform.nv_flush() {
+            tracing::error!("failed to flush NV commits after TPM2_Shutdown: {}", e);
+        }
+    }
+
+    platform.clock_end_command();
+    platform.entropy_pool_maintain();
+
+    response_size as usize
+}
+
+/// A manufactured TPM, used as a template to quickly provision new instances
+/// via [`InitKind::ColdInitFromTemplate`].
+///
+/// Manufacturing a TPM involves initializing its entire NV state, most of which
+/// is identical across instances. A template captures that state once, and
+/// provisioning an instance from it only involves copying the template's NV
+/// state, and generating the instance's own secrets.
 ///
-/// Only a single instance of `MsTpm20RefPlatform` can be live at any given
-/// time. If [`MsTpm20RefPlatform::initialize`] is called while a instance of
-/// `MsTpm20Platform` is still live, it will return an
-/// [`Error::AlreadyInitialized`].
+/// Templates are cheap to clone, and can be shared across threads.
+#[derive(Clone)]
+pub struct InstanceTemplate {
+    nvmem: Arc<[u8]>,
+}
+
+impl core::fmt::Debug for InstanceTemplate {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("InstanceTemplate").finish_non_exhaustive()
+    }
+}
+
+impl InstanceTemplate {
+    /// Manufacture a new template.
+    ///
+    /// A throwaway instance is manufactured using the given callbacks, which
+    /// must provide real entropy. Any NV commits made by the throwaway instance
+    /// can be ignored.
+    pub fn manufacture(
+        callbacks: Box<dyn PlatformCallbacks + Send>,
+    ) -> Result<InstanceTemplate, Error> {
+        let platform = MsTpm20RefPlatform::initialize(callbacks, InitKind::ColdInit)?;
+
+        let nvmem = {
+            let _engine = platform.enter();
+            let platform = PLATFORM.try_lock().unwrap();
+            let platform = platform.as_ref().expect("platform is initialized");
+            platform.state.nvmem.region.to_vec()
+        };
+
+        Ok(InstanceTemplate {
+            nvmem: nvmem.into(),
+        })
+    }
+}
+
+/// A handle to an instance of the TPM library.
 ///
-/// When `MsTpm20RefPlatform` is dropped, it will uninitialize the platform,
-/// allowing a subsequent call to [`MsTpm20RefPlatform::initialize`] to succeed.
+/// Any number of `MsTpm20RefPlatform` instances can be live at any given time.
+/// Since the underlying C library only supports running a single TPM at a
+/// time, instances are transparently swapped in and out of the C library as
+/// they are used, with calls into different instances (potentially from
+/// different threads) being serialized.
+///
+/// Swapping between instances is not free, and involves copying the runtime
+/// state of the C library. Consecutive calls into the same instance do not
+/// incur any swapping overhead.
+///
+/// When `MsTpm20RefPlatform` is dropped, it will uninitialize the instance.
 #[non_exhaustive]
 #[derive(Debug)]
 pub struct MsTpm20RefPlatform {
+    id: u64,
+    snapshot: Option<snapshot::Snapshot>,
+    metrics: Option<Arc<metrics::Metrics>>,
+    cancel_handle: CancelHandle,
     _not_sync: PhantomData<*const ()>,
 }
 
-// SAFETY: the underlying C library is single threaded, and doesn't use TLS
+// SAFETY: the underlying C library is single threaded, and doesn't use TLS.
+// All calls into the C library are serialized via the global `ENGINE` mutex.
 unsafe impl Send for MsTpm20RefPlatform {}
 
 impl MsTpm20RefPlatform {
@@ -96,19 +618,92 @@ impl MsTpm20RefPlatform {
         callbacks: Box<dyn PlatformCallbacks + Send>,
         init_kind: InitKind<'_>,
     ) -> Result<MsTpm20RefPlatform, Error> {
+        Self::initialize_with_config(callbacks, init_kind, PlatformConfig::default())
+    }
+
+    /// Initialize the TPM library with the given implementation-specific
+    /// callbacks and platform configuration.
+    ///
+    /// NOTE: This method does NOT automatically send any TPM startup commands.
+    pub fn initialize_with_config(
+        callbacks: Box<dyn PlatformCallbacks + Send>,
+        init_kind: InitKind<'_>,
+        config: PlatformConfig,
+    ) -> Result<MsTpm20RefPlatform, Error> {
+        let mut engine = ENGINE.lock().unwrap();
+
+        engine.make_pristine();
+
+        let metrics = config.metrics.then(|| Arc::new(metrics::Metrics::new()));
+        let cancel_handle = CancelHandle::new();
+        if let Err(e) = Self::initialize_resident(
+            callbacks,
+            init_kind,
+            config,
+            metrics.clone(),
+            cancel_handle.clone(),
+        ) {
+            // tear down the partially initialized platform
+            if let Some(mut platform) = PLATFORM.try_lock().unwrap().take() {
+                platform.signal_power_off();
+            }
+            return Err(e);
+        }
+
+        let id = engine.next_id;
+        engine.next_id += 1;
+        engine.resident = Some(id);
+
+        Ok(MsTpm20RefPlatform {
+            id,
+            snapshot: None,
+            metrics,
+            cancel_handle,
+            _not_sync: PhantomData,
+        })
+    }
+
+    /// Initialize a new instance directly into the C library globals.
+    ///
+    /// Must be called with the engine lock held, and no instance resident.
+    fn initialize_resident(
+        callbacks: Box<dyn PlatformCallbacks + Send>,
+        init_kind: InitKind<'_>,
+        config: PlatformConfig,
+        metrics: Option<Arc<metrics::Metrics>>,
+        cancel_handle: CancelHandle,
+    ) -> Result<(), Error> {
         tracing::trace!("Initializing TPM platform...");
 
+        let from_template = matches!(&init_kind, InitKind::ColdInitFromTemplate { .. });
+        let manufacture = matches!(
+            &init_kind,
+            InitKind::ColdInit
+                | InitKind::ColdInitWithNvRegion {
+                    manufacture: true,
+                    ..
+                }
+        );
+
         let mut maybe_platform = PLATFORM.try_lock().unwrap();
 
         match &mut *maybe_platform {
             Some(_platform) => return Err(Error::AlreadyInitialized),
             None => {
-                let mut platform = MsTpm20RefPlatformImpl::new(callbacks);
-                match &init_kind {
+                let mut platform =
+                    MsTpm20RefPlatformImpl::new(callbacks, config, metrics, cancel_handle);
+                match init_kind {
                     InitKind::ColdInit => platform.nv_enable()?,
                     InitKind::ColdInitWithPersistentState { nvmem_blob } => {
                         platform.nv_enable_from_blob(nvmem_blob)?
                     }
+                    InitKind::ColdInitWithNvRegion {
+                        region,
+                        manufacture,
+                    } => platform.nv_enable_from_region(region, manufacture)?,
+                    InitKind::ColdInitFromTemplate { template } => {
+                        platform.nv_enable_from_template(&template.nvmem)?
+                    }
                 };
                 *maybe_platform = Some(platform);
             }
@@ -120,61 +715,85 @@ impl MsTpm20RefPlatform {
         // itself to prep the TPM.
         tracing::trace!("Initializing TPM library...");
 
-        maybe_platform.as_mut().unwrap().signal_power_on()?;
+        let platform = maybe_platform.as_mut().unwrap();
+        platform.signal_power_on()?;
+
+        let res = with_active_platform(platform, || {
+            if manufacture {
+                // SAFETY: TPM_Manufacture doesn't have any preconditions
+                let ret = unsafe { ffi::TPM_Manufacture(true as i32) };
+                if ret != 0 {
+                    return Err(Error::Ffi {
+                        function: "TPM_Manufacture",
+                        error: ret,
+                    });
+                }
+            }
 
-        // Make sure to drop the mutex guard, as the TPM library will call back into the
-        // platform, and Rust's std mutex is not reentrant!
-        drop(maybe_platform);
+            flush_mont_cache();
+            // SAFETY: the nvram state has been manufactured (either by loading an existing
+            // nvram blob, or through TPM_Manufacture), and has been powered on.
+            unsafe { ffi::_TPM_Init() }
 
-        if matches!(&init_kind, InitKind::ColdInit) {
-            // SAFETY: TPM_Manufacture doesn't have any preconditions
-            let ret = unsafe { ffi::TPM_Manufacture(true as i32) };
-            if ret != 0 {
-                return Err(Error::Ffi {
-                    function: "TPM_Manufacture",
-                    error: ret,
-                });
+            if from_template {
+                // SAFETY: _TPM_Init has been called, and TPM2_Startup hasn't.
+                let ret = unsafe { INJECTED_ReseedManufacturedState() };
+                if ret != 0 {
+                    return Err(Error::Ffi {
+                        function: "INJECTED_ReseedManufacturedState",
+                        error: ret,
+                    });
+                }
             }
-        }
 
-        // SAFETY: the nvram state has been manufactured (either by loading an existing
-        // nvram blob, or through TPM_Manufacture), and has been powered on.
-        unsafe { ffi::_TPM_Init() }
+            Ok(())
+        });
+        // the DRBG runs AES during manufacturing and _TPM_Init
+        reset_aes_contexts();
+        res?;
         tracing::trace!("_TPM_Init Completed");
 
         tracing::info!("TPM library initialized");
 
-        Ok(MsTpm20RefPlatform {
-            _not_sync: PhantomData,
-        })
+        Ok(())
+    }
+
+    /// Lock the engine, swapping this instance into the C library if required.
+    ///
+    /// The returned guard must be held for the entire duration of any call
+    /// into the C library, or any access to `PLATFORM`.
+    fn enter(&self) -> MutexGuard<'static, Engine> {
+        let mut engine = ENGINE.lock().unwrap();
+        engine.make_resident(self.id);
+        engine
     }
 
     /// Reset the TPM device (i.e: simulate power off + power on)
     pub fn reset(&mut self, with_new_nvmem_blob: Option<&[u8]>) -> Result<(), Error> {
         tracing::trace!("Resetting TPM library...");
-        // open new scope to drop the mutex before calling _TPM_Init
-        {
-            let mut platform = PLATFORM.try_lock().unwrap();
-            let platform = platform.as_mut().unwrap();
-            platform.signal_power_off();
-
-            if let Some(nvmem_blob) = with_new_nvmem_blob {
-                platform.nv_enable_from_blob(nvmem_blob)?;
-            } else {
-                // instead of requiring the caller to do a full roundtrip
-                // through their backing nvmem storage as part of the reset, we
-                // cheat and set this flag to true (after it was cleared as part
-                // of signal_power_off), which lets us re-use the current nvmem
-                // state in memory.
-                platform.state.nvmem.is_init = true;
-            }
+        let _engine = self.enter();
+        let mut platform = PLATFORM.try_lock().unwrap();
+        let platform = platform.as_mut().unwrap();
+        platform.nv_flush()?;
+        platform.signal_power_off();
 
-            platform.signal_power_on()?;
+        if let Some(nvmem_blob) = with_new_nvmem_blob {
+            platform.nv_enable_from_blob(nvmem_blob.into())?;
+        } else {
+            // instead of requiring the caller to do a full roundtrip
+            // through their backing nvmem storage as part of the reset, we
+            // cheat and set this flag to true (after it was cleared as part
+            // of signal_power_off), which lets us re-use the current nvmem
+            // state in memory.
+            platform.state.nvmem.is_init = true;
         }
+
+        platform.signal_power_on()?;
+
+        flush_mont_cache();
         // SAFETY: nvram is in a valid state, and the device is powered on.
-        unsafe {
-            ffi::_TPM_Init();
-        }
+        with_active_platform(platform, || unsafe { ffi::_TPM_Init() });
+        reset_aes_contexts();
         tracing::trace!("TPM Reset");
         Ok(())
     }
@@ -191,59 +810,10 @@ impl MsTpm20RefPlatform {
         request: &mut [u8],
         response: &mut [u8],
     ) -> usize {
-        let request_size = request.len() as u32;
-        let request_ptr = request.as_mut_ptr();
-        let mut response_size = response.len() as u32;
-        let mut response_ptr = response.as_mut_ptr();
-
-        let prev_response_ptr = response_ptr;
-        // SAFETY: The request / response buffers point to valid Rust slices
-        unsafe {
-            RunCommand(
-                request_size,
-                request_ptr,
-                &mut response_size,
-                &mut response_ptr,
-            );
-        }
-
-        // NOTE: the API of the underlying C library makes it possible for the
-        // underlying C library to modify the response pointer to point to a
-        // different buffer than the one passed in.
-        //
-        // The common use case is to return a pointer to a global static buffer
-        // when the TPM enters a failure mode. This is pretty easy to handle, as
-        // we can simply copy data from said buffer into the response buffer
-        // prior to returning from the function.
-        //
-        // That said, we do need to be careful against the possible case of the
-        // C library returning a response pointer that points into the provided
-        // request buffer. In that case, naively using
-        // `slice::from_raw_parts_mut` would result in UB, as it would result in
-        // two mutable Rust slices which alias the same memory location.
-        //
-        // This doesn't happen in the current version of the library, but we
-        // double-check and handle this edge-case regardless.
-        if prev_response_ptr != response_ptr {
-            if response_ptr == request_ptr {
-                panic!("TPM library unexpectedly returned a response in request buffer");
-            }
-
-            if response_ptr.is_null() {
-                panic!("TPM library set response pointer to null");
-            }
-
-            tracing::warn!("TPM library returned a response ptr that doesn't match the provided response buffer: {:#x?} != {:#x?}", prev_response_ptr, response_ptr);
-
-            // copy response from library provided response buffer into user response buffer
-            //
-            // SAFETY: C library is returning a valid, albeit different, pointer.
-            let c_response =
-                unsafe { core::slice::from_raw_parts_mut(response_ptr, response_size as usize) };
-            response[..response_size as usize].copy_from_slice(c_response);
-        }
-
-        response_size as usize
+        let _engine = self.enter();
+        // SAFETY: the instance is resident, and the caller has upheld the
+        // buffer size requirements.
+        unsafe { run_command(request, response, self.metrics.as_deref()) }
     }
 
     /// Execute a command on the TPM.
@@ -252,63 +822,152 @@ impl MsTpm20RefPlatform {
         request: &mut [u8],
         response: &mut [u8],
     ) -> Result<usize, Error> {
-        let request_len = request.len();
-        let request_header_size = request
-            .get(2..6)
-            .map(|b| u32::from_be_bytes(b.try_into().unwrap()))
-            .ok_or(Error::InvalidRequestSize)?;
-
-        if request_header_size > request_len as u32 {
-            return Err(Error::InvalidRequestSize);
-        }
+        let request_len = checked_request_len(request)?;
 
         // SAFETY: the request buffer has been truncated to the size specified
         // in the request header
-        Ok(unsafe {
-            self.execute_command_unchecked(
-                &mut request[..request_len.min(request_header_size as usize)],
-                response,
-            )
-        })
+        Ok(unsafe { self.execute_command_unchecked(&mut request[..request_len], response) })
+    }
+
+    /// Execute a batch of commands on the TPM, in order.
+    ///
+    /// Each slot's `result` is set to the outcome of its command, exactly as
+    /// if it had been passed to [`execute_command`](Self::execute_command). A
+    /// malformed request only fails its own slot; subsequent commands are still
+    /// executed.
+    ///
+    /// Compared to calling `execute_command` in a loop, the instance is only
+    /// made resident (and the engine lock only acquired) once per batch.
+    pub fn execute_commands(&mut self, slots: &mut [CommandSlot<'_>]) {
+        let _engine = self.enter();
+        for slot in slots {
+            slot.result = Some(checked_request_len(slot.request).map(|request_len| {
+                // SAFETY: the instance is resident, and the request buffer has
+                // been truncated to the size specified in the request header
+                unsafe {
+                    run_command(
+                        &mut slot.request[..request_len],
+                        slot.response,
+                        self.metrics.as_deref(),
+                    )
+                }
+            }));
+        }
+    }
+
+    /// Return a snapshot of the metrics collected by this instance, or `None`
+    /// if metrics collection wasn't enabled via [`PlatformConfig::metrics`].
+    ///
+    /// Unlike most other methods, this does not need to swap the instance into
+    /// the C library, and is cheap to call at any time.
+    pub fn metrics(&self) -> Option<PlatformMetrics> {
+        self.metrics.as_ref().map(|m| m.snapshot())
     }
 
     /// Save the current state into an opaque saved-state blob.
     pub fn save_state(&self) -> Vec<u8> {
-        let state = MsTpm20RefRuntimeState {
-            tpmlib_state: tpmlib_state::get_runtime_state(),
-            platform_state: PLATFORM
-                .try_lock()
-                .unwrap()
-                .as_mut()
-                .expect("platform is initialized")
-                .get_runtime_state(),
-        };
+        let mut out = Vec::new();
+        self.save_state_into(&mut out);
+        out
+    }
+
+    /// Save the TPM's state into `out`, replacing its contents.
+    ///
+    /// Produces the exact same blob as [`save_state`](Self::save_state), but
+    /// lets callers re-use the same buffer across calls. Once `out` is
+    /// sufficiently large, this method does not allocate (unless
+    /// [`PlatformConfig::compact_saved_state`] is set).
+    pub fn save_state_into(&self, out: &mut Vec<u8>) {
+        let _engine = self.enter();
+        let mut platform = PLATFORM.try_lock().unwrap();
+        let platform = platform.as_mut().expect("platform is initialized");
+
+        let tpmlib_state_size = tpmlib_state::runtime_state_size();
 
-        postcard::to_stdvec(&state).expect("failed to serialize state")
+        if platform.compact_saved_state {
+            let mut tpmlib_state = vec![0; tpmlib_state_size];
+            tpmlib_state::get_runtime_state_into(&mut tpmlib_state);
+
+            platform.with_nv_region_detached(|state, nv_region| {
+                encode_compact_state(out, &tpmlib_state, state, nv_region)
+            });
+            return;
+        }
+
+        out.clear();
+        // leave room for the length prefixes and the rest of the platform state
+        out.reserve(tpmlib_state_size + platform.state.nvmem.region.len() + 64);
+
+        // This is a hand-rolled serialization of `MsTpm20RefRuntimeState`,
+        // which has the C library write its state directly into `out`.
+        //
+        // postcard encodes the library state's `Vec<u8>` as a varint length
+        // prefix followed by the raw bytes.
+        let mut buf = postcard::to_extend(&tpmlib_state_size, std::mem::take(out))
+            .expect("failed to serialize state");
+        let start = buf.len();
+        buf.resize(start + tpmlib_state_size, 0);
+        tpmlib_state::get_runtime_state_into(&mut buf[start..]);
+
+        *out = postcard::to_extend(&platform.state, buf).expect("failed to serialize state");
     }
 
     /// Restore the TPM from a previously-saved blob.
     pub fn restore_state(&mut self, state: Vec<u8>) -> Result<(), Error> {
-        let state: MsTpm20RefRuntimeState =
-            postcard::from_bytes(&state).map_err(Error::FailedPlatformRestore)?;
+        let state = match state.strip_prefix(&COMPACT_STATE_MAGIC) {
+            Some(compact) => {
+                let (tpmlib_state, mut platform_state, nv_region): (
+                    Vec<u8>,
+                    MsTpm20PlatformState,
+                    Vec<u8>,
+                ) = postcard::from_bytes(compact).map_err(Error::FailedPlatformRestore)?;
+
+                let tpmlib_state =
+                    sparse::decode(&tpmlib_state, tpmlib_state::runtime_state_size())?;
+                platform_state.nvmem.region = api::nvmem::NvRegion::Owned(sparse::decode(
+                    &nv_region,
+                    api::nvmem::NV_MEMORY_SIZE,
+                )?);
 
+                MsTpm20RefRuntimeState {
+                    tpmlib_state: tpmlib_state::MsTpm20RefLibraryState::from_bytes(tpmlib_state),
+                    platform_state,
+                }
+            }
+            None => postcard::from_bytes(&state).map_err(Error::FailedPlatformRestore)?,
+        };
+
+        let _engine = self.enter();
+        flush_mont_cache();
         PLATFORM
             .try_lock()
             .unwrap()
             .as_mut()
             .expect("platform is initialized")
-            .restore_runtime_state(state.platform_state);
+            .restore_runtime_state(state.platform_state)?;
 
         tpmlib_state::restore_runtime_state(state.tpmlib_state)?;
 
         Ok(())
     }
 
+    /// Synchronously persist any NV commits which have yet to be persisted.
+    ///
+    /// This is a no-op unless the platform was initialized with
+    /// [`NvCommitPolicy::Coalesced`](crate::NvCommitPolicy::Coalesced).
+    pub fn flush_nv_commits(&mut self) -> Result<(), Error> {
+        let _engine = self.enter();
+        let mut platform = PLATFORM.try_lock().unwrap();
+        let platform = platform.as_mut().expect("platform is initialized");
+        platform.nv_flush()
+    }
+
     /// Sets or resets the Cancel flag.
     ///
     /// When set the TPM library will opportunistically abort the command being
     /// executed.
     pub fn set_cancel_flag(&mut self, enabled: bool) {
+        let _engine = self.enter();
         let mut platform = PLATFORM.try_lock().unwrap();
         let platform = platform.as_mut().expect("platform is initialized");
         if enabled {
@@ -317,13 +976,34 @@ impl MsTpm20RefPlatform {
             platform.clear_cancel()
         }
     }
+
+    /// Return a handle which can be used to abort the command being executed
+    /// by this instance from another thread.
+    ///
+    /// See [`CancelHandle::cancel`] for details.
+    pub fn cancel_handle(&self) -> CancelHandle {
+        self.cancel_handle.clone()
+    }
+
+    /// Move this instance onto a dedicated thread, returning an async-friendly
+    /// handle to it. See [`AsyncMsTpm20RefPlatform`].
+    pub fn into_async(self) -> Result<AsyncMsTpm20RefPlatform, Error> {
+        AsyncMsTpm20RefPlatform::new(self)
+    }
 }
 
 impl Drop for MsTpm20RefPlatform {
     fn drop(&mut self) {
-        let mut platform = PLATFORM.try_lock().unwrap();
-        platform.as_mut().unwrap().signal_power_off();
-        *platform = None;
+        let mut engine = ENGINE.lock().unwrap();
+        if engine.resident == Some(self.id) {
+            engine.remove_resident().signal_power_off();
+        } else {
+            let mut parked = engine
+                .parked
+                .remove(&self.id)
+                .expect("instance is registered");
+            parked.platform.signal_power_off();
+        }
     }
 }
 
@@ -349,25 +1029,95 @@ impl MsTpm20PlatformState {
 }
 
 struct MsTpm20RefPlatformImpl {
-    callbacks: Box<dyn PlatformCallbacks + Send>,
+    callbacks: callbacks::Callbacks,
+    metrics: Option<Arc<metrics::Metrics>>,
+    entropy_pool: Option<api::entropy::EntropyPool>,
+    coarse_clock: bool,
+    // monotonic timer sample for the current command (see `coarse_clock`)
+    clock_sample: Option<u128>,
+    compact_saved_state: bool,
+    cancel_handle: CancelHandle,
+    nv_scheduler: Option<nv_commit::NvCommitScheduler>,
     state: MsTpm20PlatformState,
 }
 
 impl MsTpm20RefPlatformImpl {
-    fn new(callbacks: Box<dyn PlatformCallbacks + Send>) -> MsTpm20RefPlatformImpl {
+    fn new(
+        mut callbacks: Box<dyn PlatformCallbacks + Send>,
+        config: PlatformConfig,
+        metrics: Option<Arc<metrics::Metrics>>,
+        cancel_handle: CancelHandle,
+    ) -> MsTpm20RefPlatformImpl {
+        let (callbacks, nv_scheduler) = match config.nv_commit_policy {
+            NvCommitPolicy::WriteThrough => (callbacks::CallbacksKind::Owned(callbacks), None),
+            NvCommitPolicy::Coalesced {
+                max_delay,
+                max_commits,
+            } => {
+                // with dedicated NV commit callbacks, the flusher thread never
+                // needs to touch the platform callbacks
+                let (callbacks, sink) = match callbacks.nv_commit_callbacks() {
+                    Some(nv_callbacks) => (
+                        callbacks::CallbacksKind::Owned(callbacks),
+                        nv_commit::NvSink::Dedicated(Mutex::new(nv_callbacks)),
+                    ),
+                    None => {
+                        let callbacks = Arc::new(Mutex::new(callbacks));
+                        (
+                            callbacks::CallbacksKind::Shared(callbacks.clone()),
+                            nv_commit::NvSink::Shared(callbacks),
+                        )
+                    }
+                };
+                let scheduler = nv_commit::NvCommitScheduler::new(
+                    sink,
+                    metrics.clone(),
+                    max_delay,
+                    max_commits,
+                );
+                (callbacks, Some(scheduler))
+            }
+        };
+
         MsTpm20RefPlatformImpl {
-            callbacks,
+            callbacks: callbacks::Callbacks::new(callbacks, metrics.clone()),
+            metrics,
+            entropy_pool: config.entropy_pool.map(api::entropy::EntropyPool::new),
+            coarse_clock: config.coarse_clock,
+            clock_sample: None,
+            compact_saved_state: config.compact_saved_state,
+            cancel_handle,
+            nv_scheduler,
             state: MsTpm20PlatformState::new(),
         }
     }
 
-    fn restore_runtime_state(&mut self, state: MsTpm20PlatformState) {
+    fn restore_runtime_state(&mut self, mut state: MsTpm20PlatformState) -> Result<(), Error> {
+        self.nv_restore(&mut state.nvmem)?;
         self.state = state;
+        // the restored NV region may not match what the platform has persisted
+        self.nv_mark_all_dirty();
+        Ok(())
     }
 
     fn get_runtime_state(&self) -> MsTpm20PlatformState {
         self.state.clone()
     }
+
+    /// Call `f` with the platform state (minus its NV region), and the NV
+    /// region, e.g: to serialize the NV region using a different encoding.
+    fn with_nv_region_detached<R>(
+        &mut self,
+        f: impl FnOnce(&MsTpm20PlatformState, &[u8]) -> R,
+    ) -> R {
+        let region = std::mem::replace(
+            &mut self.state.nvmem.region,
+            api::nvmem::NvRegion::Owned(Vec::new()),
+        );
+        let ret = f(&self.state, &region);
+        self.state.nvmem.region = region;
+        ret
+    }
 }
 
 /// This function is never called but is present to ensure openssl-sys is linked
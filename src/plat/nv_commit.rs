@@ -0,0 +1,338 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Background NV commit scheduling, used to implement
+//! [`NvCommitPolicy::Coalesced`](crate::NvCommitPolicy::Coalesced).
+//!
+//! Commits from the TPM library are staged into an in-memory copy of the NV
+//! region, and are persisted by a background flusher thread once either
+//! `max_delay` has elapsed since the first staged commit, or `max_commits`
+//! commits have been staged.
+//!
+//! Errors encountered by the flusher thread are reported back to the TPM
+//! library on the subsequent commit, with the failed ranges being retried as
+//! part of the next flush (no sooner than `max_delay` after the failure).
+//!
+//! If the platform provides dedicated [`NvCommitCallbacks`], the flusher
+//! commits through those, and never touches the platform callbacks used by the
+//! TPM library while executing commands.
+
+use std::sync::Arc;
+use std::sync::Condvar;
+use std::sync::Mutex;
+use std::thread::JoinHandle;
+use std::time::Duration;
+use std::time::Instant;
+
+use crate::error::Error;
+use crate::DynResult;
+use crate::NvCommitCallbacks;
+
+use super::api::nvmem::DirtyRanges;
+use super::callbacks::BoxedCallbacks;
+use super::metrics::Metrics;
+
+struct Pending {
+    region: Vec<u8>,
+    dirty: DirtyRanges,
+    commits: u32,
+    first_staged: Instant,
+}
+
+/// Where staged commits are persisted to.
+pub enum NvSink {
+    /// Dedicated NV commit callbacks, provided by
+    /// [`PlatformCallbacks::nv_commit_callbacks`](crate::PlatformCallbacks::nv_commit_callbacks).
+    Dedicated(Mutex<Box<dyn NvCommitCallbacks>>),
+    /// The platform callbacks, shared with the TPM library. Callbacks made by
+    /// a command wait on any commit in progress.
+    Shared(Arc<Mutex<BoxedCallbacks>>),
+}
+
+impl NvSink {
+    fn commit_nv_delta(&self, state: &[u8], dirty: &[(usize, &[u8])]) -> DynResult<()> {
+        match self {
+            NvSink::Dedicated(callbacks) => callbacks.lock().unwrap().commit_nv_delta(state, dirty),
+            NvSink::Shared(callbacks) => callbacks.lock().unwrap().commit_nv_delta(state, dirty),
+        }
+    }
+}
+
+impl Pending {
+    fn commit(&self, sink: &NvSink, metrics: Option<&Metrics>) -> DynResult<()> {
+        let start = metrics.map(|_| Instant::now());
+        let res = sink.commit_nv_delta(&self.region, &self.dirty.slices(&self.region));
+        if let (Some(metrics), Some(start)) = (metrics, start) {
+            metrics.record_callback(start.elapsed());
+        }
+        res
+    }
+}
+
+#[derive(Default)]
+struct SchedulerState {
+    pending: Option<Pending>,
+    // recycled staging buffer
+    spare: Option<Vec<u8>>,
+    error: Option<Box<dyn std::error::Error + Send + Sync>>,
+    in_flight: bool,
+    shutdown: bool,
+}
+
+impl SchedulerState {
+    /// Re-queue a pending commit which failed to be persisted.
+    ///
+    /// The retry is scheduled as though the commit had just been staged, so
+    /// that a persistently failing backend is retried every `max_delay`,
+    /// rather than in a tight loop (which is what would happen if the failed
+    /// commit had been flushed on account of `max_commits`).
+    fn requeue(&mut self, failed: Pending) {
+        match &mut self.pending {
+            // a newer staged region is a superset of the failed one, so all
+            // that's required is to make sure the failed ranges get re-written
+            Some(pending) => pending.dirty.merge(&failed.dirty),
+            None => {
+                self.pending = Some(Pending {
+                    commits: 0,
+                    first_staged: Instant::now(),
+                    ..failed
+                })
+            }
+        }
+    }
+}
+
+struct Shared {
+    state: Mutex<SchedulerState>,
+    cond: Condvar,
+    sink: NvSink,
+    metrics: Option<Arc<Metrics>>,
+    max_delay: Duration,
+    max_commits: u32,
+}
+
+pub struct NvCommitScheduler {
+    shared: Arc<Shared>,
+    flusher: Option<JoinHandle<()>>,
+}
+
+impl NvCommitScheduler {
+    pub fn new(
+        sink: NvSink,
+        metrics: Option<Arc<Metrics>>,
+        max_delay: Duration,
+        max_commits: u32,
+    ) -> NvCommitScheduler {
+        let shared = Arc::new(Shared {
+            state: Mutex::new(SchedulerState::default()),
+            cond: Condvar::new(),
+            sink,
+            metrics,
+            max_delay,
+            max_commits: max_commits.max(1),
+        });
+
+        let flusher = std::thread::Builder::new()
+            .name("tpm-nv-flusher".into())
+            .spawn({
+                let shared = shared.clone();
+                move || shared.run_flusher()
+            })
+            .expect("failed to spawn NV flusher thread");
+
+        NvCommitScheduler {
+            shared,
+            flusher: Some(flusher),
+        }
+    }
+
+    /// Stage the current NV region for a background commit.
+    ///
+    /// Returns any error encountered by a previous background commit. The
+    /// region is staged regardless, so that it gets persisted alongside the
+    /// failed commit's retry.
+    pub fn stage(&self, region: &[u8], dirty: &DirtyRanges) -> Result<(), Error> {
+        let mut state = self.shared.state.lock().unwrap();
+
+        match &mut state.pending {
+            Some(pending) => {
+                pending.region.clear();
+                pending.region.extend_from_slice(region);
+                pending.dirty.merge(dirty);
+                pending.commits += 1;
+            }
+            None => {
+                let mut buf = state.spare.take().unwrap_or_default();
+                buf.clear();
+                buf.extend_from_slice(region);
+                state.pending = Some(Pending {
+                    region: buf,
+                    dirty: dirty.clone(),
+                    commits: 1,
+                    first_staged: Instant::now(),
+                });
+            }
+        }
+
+        self.shared.cond.notify_all();
+
+        match state.error.take() {
+            Some(e) => Err(Error::PlatformCallback(e)),
+            None => Ok(()),
+        }
+    }
+
+    /// Synchronously persist any staged commits.
+    pub fn flush(&self) -> Result<(), Error> {
+        let mut state = self.shared.state.lock().unwrap();
+        while state.in_flight {
+            state = self.shared.cond.wait(state).unwrap();
+        }
+
+        // any previously reported error is moot if the retry succeeds
+        state.error = None;
+
+        let pending = match state.pending.take() {
+            Some(pending) => pending,
+            None => return Ok(()),
+        };
+
+        state.in_flight = true;
+        drop(state);
+
+        let res = pending.commit(&self.shared.sink, self.shared.metrics.as_deref());
+
+        let mut state = self.shared.state.lock().unwrap();
+        state.in_flight = false;
+        let res = match res {
+            Ok(()) => {
+                state.spare = Some(pending.region);
+                Ok(())
+            }
+            Err(e) => {
+                state.requeue(pending);
+                Err(Error::PlatformCallback(e))
+            }
+        };
+        self.shared.cond.notify_all();
+
+        res
+    }
+}
+
+impl Shared {
+    fn run_flusher(&self) {
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if state.shutdown {
+                return;
+            }
+
+            let pending = match &state.pending {
+                Some(pending) if !state.in_flight => pending,
+                _ => {
+                    state = self.cond.wait(state).unwrap();
+                    continue;
+                }
+            };
+
+            let deadline = pending.first_staged + self.max_delay;
+            let now = Instant::now();
+            if pending.commits < self.max_commits && now < deadline {
+                state = self.cond.wait_timeout(state, deadline - now).unwrap().0;
+                continue;
+            }
+
+            let pending = state.pending.take().unwrap();
+            state.in_flight = true;
+            drop(state);
+
+            let res = pending.commit(&self.sink, self.metrics.as_deref());
+
+            state = self.state.lock().unwrap();
+            state.in_flight = false;
+            match res {
+                Ok(()) => state.spare = Some(pending.region),
+                Err(e) => {
+                    tracing::error!("background NV commit failed: {}", e);
+                    state.requeue(pending);
+                    state.error = Some(e);
+                }
+            }
+            self.cond.notify_all();
+        }
+    }
+}
+
+impl Drop for NvCommitScheduler {
+    fn drop(&mut self) {
+        if let Err(e) = self.flush() {
+            tracing::error!("failed to flush NV commits: {}", e);
+        }
+
+        self.shared.state.lock().unwrap().shutdown = true;
+        self.shared.cond.notify_all();
+        if let Some(flusher) = self.flusher.take() {
+            let _ = flusher.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    type Commits = Arc<Mutex<Vec<(Vec<u8>, Vec<usize>)>>>;
+
+    /// Records every successful commit, after failing the first one.
+    struct FailOnce {
+        failed: bool,
+        commits: Commits,
+    }
+
+    impl NvCommitCallbacks for FailOnce {
+        fn commit_nv_delta(&mut self, state: &[u8], dirty: &[(usize, &[u8])]) -> DynResult<()> {
+            if !self.failed {
+                self.failed = true;
+                return Err("injected failure".into());
+            }
+            let offsets = dirty.iter().map(|(offset, _)| *offset).collect();
+            self.commits.lock().unwrap().push((state.to_vec(), offsets));
+            Ok(())
+        }
+    }
+
+    fn dirty(range: std::ops::Range<usize>) -> DirtyRanges {
+        let mut dirty = DirtyRanges::default();
+        dirty.mark(range);
+        dirty
+    }
+
+    #[test]
+    fn stage_after_failed_background_commit() {
+        let commits = Commits::default();
+        let sink = NvSink::Dedicated(Mutex::new(Box::new(FailOnce {
+            failed: false,
+            commits: commits.clone(),
+        })));
+        // flush every staged commit straight away, but never retry on a timer
+        let scheduler = NvCommitScheduler::new(sink, None, Duration::from_secs(3600), 1);
+
+        scheduler.stage(&[1; 64], &dirty(0..8)).unwrap();
+        {
+            let shared = &scheduler.shared;
+            let mut state = shared.state.lock().unwrap();
+            while state.error.is_none() {
+                state = shared.cond.wait(state).unwrap();
+            }
+        }
+
+        // the newer region is staged, even though the failure is reported
+        assert!(scheduler.stage(&[2; 64], &dirty(32..40)).is_err());
+        scheduler.flush().unwrap();
+
+        let commits = commits.lock().unwrap();
+        let (region, offsets) = commits.last().unwrap();
+        assert_eq!(region, &[2; 64]);
+        assert_eq!(offsets, &[0, 32]);
+    }
+}
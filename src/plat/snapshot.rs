@@ -0,0 +1,370 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Delta-encoded saved states.
+//!
+//! A delta only contains the chunks of the C library runtime state and NV
+//! region which have changed since a prior snapshot, alongside the (small)
+//! Rust platform state. Deltas are only ever applied on top of the exact state
+//! they were taken against, which is validated using a fingerprint of said
+//! state.
+
+use serde::Deserialize;
+use serde::Serialize;
+
+use crate::error::Error;
+use crate::tpmlib_state;
+
+use super::api::nvmem::NvRegion;
+use super::api::nvmem::NV_MEMORY_SIZE;
+use super::encode_compact_state;
+use super::flush_mont_cache;
+use super::MsTpm20PlatformState;
+use super::MsTpm20RefPlatform;
+use super::MsTpm20RefRuntimeState;
+use super::PLATFORM;
+
+/// Granularity at which state is diffed.
+const DELTA_CHUNK_SIZE: usize = 64;
+
+/// Opaque identifier for a state snapshot taken via
+/// [`MsTpm20RefPlatform::save_state_snapshot`] or
+/// [`MsTpm20RefPlatform::save_state_delta`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct SnapshotId(u64);
+
+/// The most recent snapshot taken of an instance.
+pub(super) struct Snapshot {
+    id: SnapshotId,
+    fingerprint: u64,
+    tpmlib_state: Vec<u8>,
+    nv_region: Vec<u8>,
+}
+
+impl core::fmt::Debug for Snapshot {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("Snapshot")
+            .field("id", &self.id)
+            .finish_non_exhaustive()
+    }
+}
+
+#[derive(Serialize, Deserialize)]
+struct BlobDelta {
+    len: u32,
+    // (offset, data)
+    runs: Vec<(u32, Vec<u8>)>,
+}
+
+impl BlobDelta {
+    fn new(base: &[u8], new: &[u8]) -> BlobDelta {
+        if base.len() != new.len() {
+            return BlobDelta {
+                len: new.len() as u32,
+                runs: vec![(0, new.to_vec())],
+            };
+        }
+
+        let mut runs: Vec<(u32, Vec<u8>)> = Vec::new();
+        let mut prev_dirty = false;
+        for (i, (base, new)) in base
+            .chunks(DELTA_CHUNK_SIZE)
+            .zip(new.chunks(DELTA_CHUNK_SIZE))
+            .enumerate()
+        {
+            let dirty = base != new;
+            if dirty {
+                match runs.last_mut() {
+                    Some((_, data)) if prev_dirty => data.extend_from_slice(new),
+                    _ => runs.push(((i * DELTA_CHUNK_SIZE) as u32, new.to_vec())),
+                }
+            }
+            prev_dirty = dirty;
+        }
+
+        BlobDelta {
+            len: new.len() as u32,
+            runs,
+        }
+    }
+
+    /// Check that the delta describes a blob of at most `max_len` bytes, with
+    /// every run falling within the blob.
+    fn validate(&self, max_len: usize) -> Result<(), Error> {
+        let len = self.len as usize;
+        if len > max_len {
+            return Err(Error::InvalidRestoreSize);
+        }
+        for (offset, data) in &self.runs {
+            match (*offset as usize).checked_add(data.len()) {
+                Some(end) if end <= len => {}
+                _ => return Err(Error::InvalidRestoreSize),
+            }
+        }
+        Ok(())
+    }
+
+    /// Apply a delta which passed [`validate`](Self::validate).
+    fn apply(&self, blob: &mut Vec<u8>) {
+        blob.resize(self.len as usize, 0);
+        for (offset, data) in &self.runs {
+            let offset = *offset as usize;
+            blob[offset..(offset + data.len())].copy_from_slice(data);
+        }
+    }
+}
+
+#[derive(Serialize, Deserialize)]
+struct MsTpm20RefStateDelta {
+    base_fingerprint: u64,
+    tpmlib_state: BlobDelta,
+    nv_region: BlobDelta,
+    // with an empty NV region
+    platform_state: MsTpm20PlatformState,
+}
+
+/// 64-bit FNV-1a
+fn fingerprint(tpmlib_state: &[u8], nv_region: &[u8]) -> u64 {
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for b in tpmlib_state.iter().chain(nv_region) {
+        hash ^= *b as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+    }
+    hash
+}
+
+fn next_snapshot_id() -> SnapshotId {
+    use std::sync::atomic::AtomicU64;
+    use std::sync::atomic::Ordering;
+
+    static NEXT_ID: AtomicU64 = AtomicU64::new(0);
+    SnapshotId(NEXT_ID.fetch_add(1, Ordering::Relaxed))
+}
+
+impl MsTpm20RefPlatform {
+    /// Returns the C library state, the platform state (with an empty NV
+    /// region), the NV region, and whether saved state should use the compact
+    /// encoding.
+    fn capture_state(&self) -> (Vec<u8>, MsTpm20PlatformState, Vec<u8>, bool) {
+        let _engine = self.enter();
+        let tpmlib_state = tpmlib_state::get_runtime_state().into_bytes();
+        let mut platform = PLATFORM.try_lock().unwrap();
+        let platform = platform.as_mut().expect("platform is initialized");
+
+        // avoid cloning the NV region along with the rest of the state
+        let region = std::mem::replace(
+            &mut platform.state.nvmem.region,
+            NvRegion::Owned(Vec::new()),
+        );
+        let platform_state = platform.get_runtime_state();
+        let nv_region = region.to_vec();
+        platform.state.nvmem.region = region;
+
+        (
+            tpmlib_state,
+            platform_state,
+            nv_region,
+            platform.compact_saved_state,
+        )
+    }
+
+    /// Save the TPM's state, retaining a snapshot of it as the base for a
+    /// subsequent [`save_state_delta`](Self::save_state_delta).
+    ///
+    /// The returned blob is identical to the one returned by
+    /// [`save_state`](Self::save_state), and can be restored using
+    /// [`restore_state`](Self::restore_state).
+    pub fn save_state_snapshot(&mut self) -> (SnapshotId, Vec<u8>) {
+        let (tpmlib_state, mut platform_state, nv_region, compact) = self.capture_state();
+
+        let blob = if compact {
+            let mut blob = Vec::new();
+            encode_compact_state(&mut blob, &tpmlib_state, &platform_state, &nv_region);
+            blob
+        } else {
+            platform_state.nvmem.region = NvRegion::Owned(nv_region.clone());
+            let state = MsTpm20RefRuntimeState {
+                tpmlib_state: tpmlib_state::MsTpm20RefLibraryState::from_bytes(
+                    tpmlib_state.clone(),
+                ),
+                platform_state,
+            };
+            postcard::to_stdvec(&state).expect("failed to serialize state")
+        };
+
+        let id = self.retain_snapshot(tpmlib_state, nv_region);
+        (id, blob)
+    }
+
+    /// Save only the parts of TPM's state which have changed since the
+    /// snapshot `since`, which must be the most recent snapshot taken of this
+    /// instance.
+    ///
+    /// On success, the returned snapshot becomes the base for subsequent
+    /// deltas.
+    ///
+    /// The delta can be applied using
+    /// [`apply_state_delta`](Self::apply_state_delta) on an instance whose
+    /// state is exactly that of `since`.
+    pub fn save_state_delta(&mut self, since: SnapshotId) -> Result<(SnapshotId, Vec<u8>), Error> {
+        let base = match &self.snapshot {
+            Some(snapshot) if snapshot.id == since => snapshot,
+            _ => return Err(Error::UnknownSnapshot),
+        };
+
+        let (tpmlib_state, platform_state, nv_region, _) = self.capture_state();
+
+        let delta = MsTpm20RefStateDelta {
+            base_fingerprint: base.fingerprint,
+            tpmlib_state: BlobDelta::new(&base.tpmlib_state, &tpmlib_state),
+            nv_region: BlobDelta::new(&base.nv_region, &nv_region),
+            platform_state,
+        };
+        let blob = postcard::to_stdvec(&delta).expect("failed to serialize state delta");
+
+        let id = self.retain_snapshot(tpmlib_state, nv_region);
+        Ok((id, blob))
+    }
+
+    fn retain_snapshot(&mut self, tpmlib_state: Vec<u8>, nv_region: Vec<u8>) -> SnapshotId {
+        let id = next_snapshot_id();
+        self.snapshot = Some(Snapshot {
+            id,
+            fingerprint: fingerprint(&tpmlib_state, &nv_region),
+            tpmlib_state,
+            nv_region,
+        });
+        id
+    }
+
+    /// Apply a delta produced by [`save_state_delta`](Self::save_state_delta)
+    /// on top of the TPM's current state.
+    ///
+    /// The TPM's current state must be exactly that of the delta's base
+    /// snapshot (i.e: it was restored from said snapshot, or from a chain of
+    /// deltas leading up to it).
+    pub fn apply_state_delta(&mut self, delta: &[u8]) -> Result<(), Error> {
+        let delta: MsTpm20RefStateDelta =
+            postcard::from_bytes(delta).map_err(Error::FailedPlatformRestore)?;
+
+        // validate the (untrusted) delta before allocating anything on its
+        // behalf, or touching any of the instance's state
+        delta
+            .tpmlib_state
+            .validate(tpmlib_state::runtime_state_size())?;
+        delta.nv_region.validate(NV_MEMORY_SIZE)?;
+
+        let (base_tpmlib_state, _, mut nv_region, _) = self.capture_state();
+
+        if fingerprint(&base_tpmlib_state, &nv_region) != delta.base_fingerprint {
+            return Err(Error::DeltaBaseMismatch);
+        }
+
+        let mut tpmlib_state = base_tpmlib_state.clone();
+        delta.tpmlib_state.apply(&mut tpmlib_state);
+        delta.nv_region.apply(&mut nv_region);
+        let mut platform_state = delta.platform_state;
+        platform_state.nvmem.region = NvRegion::Owned(nv_region);
+
+        let _engine = self.enter();
+        flush_mont_cache();
+
+        // the C library validates the restored state before applying it, so
+        // on failure nothing has changed yet
+        tpmlib_state::restore_runtime_state(tpmlib_state::MsTpm20RefLibraryState::from_bytes(
+            tpmlib_state,
+        ))?;
+
+        let res = PLATFORM
+            .try_lock()
+            .unwrap()
+            .as_mut()
+            .expect("platform is initialized")
+            .restore_runtime_state(platform_state);
+        if res.is_err() {
+            // keep the C library and platform state consistent with one another
+            tpmlib_state::restore_runtime_state(tpmlib_state::MsTpm20RefLibraryState::from_bytes(
+                base_tpmlib_state,
+            ))
+            .expect("restoring the base state cannot fail");
+        }
+
+        res
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn apply(delta: &BlobDelta, base: &[u8], max_len: usize) -> Result<Vec<u8>, Error> {
+        delta.validate(max_len)?;
+        let mut blob = base.to_vec();
+        delta.apply(&mut blob);
+        Ok(blob)
+    }
+
+    #[test]
+    fn delta_round_trip() {
+        let base = vec![0; DELTA_CHUNK_SIZE * 8 + 10];
+        let mut new = base.clone();
+        // adjacent dirty chunks are coalesced into a single run
+        new[1] = 1;
+        new[DELTA_CHUNK_SIZE + 2] = 2;
+        // as is a dirty (short) last chunk
+        new[DELTA_CHUNK_SIZE * 8 + 9] = 3;
+
+        let delta = BlobDelta::new(&base, &new);
+        assert_eq!(delta.runs.len(), 2);
+        assert_eq!(delta.runs[0].0, 0);
+        assert_eq!(delta.runs[0].1.len(), DELTA_CHUNK_SIZE * 2);
+        assert_eq!(delta.runs[1].1.len(), 10);
+        assert_eq!(apply(&delta, &base, new.len()).unwrap(), new);
+
+        let delta = BlobDelta::new(&base, &base);
+        assert!(delta.runs.is_empty());
+        assert_eq!(apply(&delta, &base, base.len()).unwrap(), base);
+    }
+
+    #[test]
+    fn delta_resized() {
+        let base = vec![0; 100];
+        let new = vec![1; 300];
+        let delta = BlobDelta::new(&base, &new);
+        assert_eq!(apply(&delta, &base, new.len()).unwrap(), new);
+
+        let new = vec![1; 10];
+        let delta = BlobDelta::new(&base, &new);
+        assert_eq!(apply(&delta, &base, new.len()).unwrap(), new);
+    }
+
+    #[test]
+    fn delta_len_exceeds_max_len() {
+        let delta = BlobDelta {
+            len: u32::MAX,
+            runs: Vec::new(),
+        };
+        assert!(matches!(
+            delta.validate(NV_MEMORY_SIZE),
+            Err(Error::InvalidRestoreSize)
+        ));
+    }
+
+    #[test]
+    fn delta_runs_out_of_bounds() {
+        let validate = |offset, len| {
+            BlobDelta {
+                len: 128,
+                runs: vec![(0, vec![0; 8]), (offset, vec![0; len])],
+            }
+            .validate(128)
+        };
+
+        assert!(validate(120, 8).is_ok());
+        assert!(matches!(validate(121, 8), Err(Error::InvalidRestoreSize)));
+        assert!(matches!(validate(128, 1), Err(Error::InvalidRestoreSize)));
+        assert!(matches!(
+            validate(u32::MAX, 2),
+            Err(Error::InvalidRestoreSize)
+        ));
+    }
+}
@@ -0,0 +1,195 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Page-bitmap encoding for mostly-zero buffers, used by the compact saved
+//! state formats.
+//!
+//! Both the NV region and much of the C library's runtime state are
+//! overwhelmingly zero-filled (particularly on freshly provisioned TPMs), so
+//! only pages containing non-zero bytes are stored.
+//!
+//! All integers are little-endian.
+//!
+//! ```text
+//! len:    u32
+//! bitmap: [u8; ceil(ceil(len / PAGE_SIZE) / 8)]
+//! pages:  contents of each page with its bit set, in order
+//! ```
+//!
+//! Bit `i % 8` of `bitmap[i / 8]` is set if page `i` contains non-zero bytes.
+//! The last page is truncated to `len`.
+
+use std::convert::TryInto;
+
+use crate::error::Error;
+
+const PAGE_SIZE: usize = 64;
+
+fn is_zero(page: &[u8]) -> bool {
+    // written as a fold (instead of `.all()`) so that it gets vectorized
+    page.iter().fold(0, |acc, &b| acc | b) == 0
+}
+
+fn bitmap_len(len: usize) -> usize {
+    len.div_ceil(PAGE_SIZE).div_ceil(8)
+}
+
+/// Upper bound on the encoded size of a `len` byte buffer.
+pub fn max_encoded_len(len: usize) -> usize {
+    4 + bitmap_len(len) + len
+}
+
+/// Append the encoded form of `data` to `out`.
+pub fn encode_into(data: &[u8], out: &mut Vec<u8>) {
+    out.reserve(max_encoded_len(data.len()));
+    out.extend_from_slice(&(data.len() as u32).to_le_bytes());
+
+    let bitmap = out.len();
+    out.resize(bitmap + bitmap_len(data.len()), 0);
+
+    for (i, page) in data.chunks(PAGE_SIZE).enumerate() {
+        if !is_zero(page) {
+            out[bitmap + i / 8] |= 1 << (i % 8);
+            out.extend_from_slice(page);
+        }
+    }
+}
+
+pub fn encode(data: &[u8]) -> Vec<u8> {
+    let mut out = Vec::new();
+    encode_into(data, &mut out);
+    out
+}
+
+/// Return the decoded size of `encoded`.
+pub fn decoded_len(encoded: &[u8]) -> Result<usize, Error> {
+    let len = encoded.get(..4).ok_or(Error::InvalidRestoreFormat)?;
+    Ok(u32::from_le_bytes(len.try_into().unwrap()) as usize)
+}
+
+/// Decode `encoded` into `out`, which must be exactly the decoded size.
+pub fn decode_into(encoded: &[u8], out: &mut [u8]) -> Result<(), Error> {
+    if decoded_len(encoded)? != out.len() {
+        return Err(Error::InvalidRestoreSize);
+    }
+
+    let bitmap_len = bitmap_len(out.len());
+    let bitmap = encoded
+        .get(4..4 + bitmap_len)
+        .ok_or(Error::InvalidRestoreFormat)?;
+    let mut pages = &encoded[4 + bitmap_len..];
+
+    for (i, page) in out.chunks_mut(PAGE_SIZE).enumerate() {
+        if bitmap[i / 8] & (1 << (i % 8)) != 0 {
+            let data = pages.get(..page.len()).ok_or(Error::InvalidRestoreFormat)?;
+            page.copy_from_slice(data);
+            pages = &pages[page.len()..];
+        } else {
+            page.fill(0);
+        }
+    }
+
+    if !pages.is_empty() {
+        return Err(Error::InvalidRestoreFormat);
+    }
+
+    Ok(())
+}
+
+/// Decode `encoded` into a new buffer, of at most `max_len` bytes.
+pub fn decode(encoded: &[u8], max_len: usize) -> Result<Vec<u8>, Error> {
+    let len = decoded_len(encoded)?;
+    if len > max_len {
+        return Err(Error::InvalidRestoreSize);
+    }
+
+    let mut out = vec![0; len];
+    decode_into(encoded, &mut out)?;
+    Ok(out)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn round_trip(data: &[u8]) {
+        let encoded = encode(data);
+        assert!(encoded.len() <= max_encoded_len(data.len()));
+        assert_eq!(decoded_len(&encoded).unwrap(), data.len());
+        assert_eq!(decode(&encoded, data.len()).unwrap(), data);
+    }
+
+    #[test]
+    fn encode_decode() {
+        round_trip(&[]);
+        round_trip(&[0; PAGE_SIZE * 9]);
+        round_trip(&[0xa5; PAGE_SIZE * 9]);
+
+        // a last page shorter than PAGE_SIZE, both zero and non-zero
+        let mut data = vec![0; PAGE_SIZE * 9 + 10];
+        data[3] = 1;
+        data[PAGE_SIZE * 8 + 1] = 2;
+        round_trip(&data);
+        data[PAGE_SIZE * 9 + 9] = 3;
+        round_trip(&data);
+    }
+
+    #[test]
+    fn zero_pages_are_omitted() {
+        let mut data = vec![0; PAGE_SIZE * 4];
+        data[PAGE_SIZE * 2] = 1;
+        assert_eq!(encode(&data).len(), 4 + 1 + PAGE_SIZE);
+    }
+
+    #[test]
+    fn truncated() {
+        // every page is non-zero, so that every prefix is missing something
+        let data = vec![0xa5; PAGE_SIZE * 20 + 5];
+        let encoded = encode(&data);
+        for len in 0..encoded.len() {
+            assert!(
+                matches!(
+                    decode(&encoded[..len], data.len()),
+                    Err(Error::InvalidRestoreFormat)
+                ),
+                "decoded a {} byte prefix",
+                len
+            );
+        }
+    }
+
+    #[test]
+    fn trailing_bytes() {
+        let mut encoded = encode(&[1; PAGE_SIZE + 1]);
+        encoded.push(0);
+        assert!(matches!(
+            decode(&encoded, PAGE_SIZE + 1),
+            Err(Error::InvalidRestoreFormat)
+        ));
+    }
+
+    #[test]
+    fn len_exceeds_max_len() {
+        let encoded = encode(&[1; 100]);
+        assert!(matches!(
+            decode(&encoded, 99),
+            Err(Error::InvalidRestoreSize)
+        ));
+
+        // rejected before anything is allocated
+        let mut encoded = u32::MAX.to_le_bytes().to_vec();
+        encoded.extend_from_slice(&[0xff; 16]);
+        assert!(matches!(
+            decode(&encoded, 0x8000),
+            Err(Error::InvalidRestoreSize)
+        ));
+    }
+
+    #[test]
+    fn decode_into_wrong_size() {
+        let encoded = encode(&[1; 100]);
+        assert!(matches!(
+            decode_into(&encoded, &mut [0; 101]),
+            Err(Error::InvalidRestoreSize)
+        ));
+    }
+}
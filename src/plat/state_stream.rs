@@ -0,0 +1,261 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Streaming, tagged saved state format.
+//!
+//! Unlike the positional blob used by [`MsTpm20RefPlatform::save_state`], each
+//! C library runtime variable is stored as a separate tagged entry, which
+//! allows the state to be produced and consumed incrementally, and allows
+//! newer library versions to skip over entries they don't recognize.
+//!
+//! All integers are little-endian.
+//!
+//! ```text
+//! magic:          [u8; 8] = "VTPMSTRM"
+//! version:        u32
+//! fingerprint:    u64 (TPM_IMPLEMENTATION_FINGERPRINT)
+//! platform_len:   u32
+//! platform_state: [u8; platform_len] (postcard)
+//! entries:        { id: u32, flags: u8, len: u32, data: [u8; len] }*
+//! end:            u32 = 0
+//! ```
+//!
+//! Entry flags:
+//!
+//! - bit 0: `data` is sparse encoded (see `sparse.rs`), and `len` is the size
+//!   of the encoded data.
+//! - all other bits are reserved, and must be zero.
+//!
+//! With [`PlatformConfig::compact_saved_state`](crate::PlatformConfig::compact_saved_state)
+//! set, every entry is sparse encoded, and the NV region is moved out of
+//! `platform_state` (which is left with an empty NV region) into a dedicated
+//! sparse encoded entry with id `NV_REGION_ENTRY_ID`.
+//!
+//! On restore, variables which are missing from the stream are reset to their
+//! pristine (i.e: pre-initialization) state.
+
+use std::io::Read;
+use std::io::Write;
+
+use crate::error::Error;
+use crate::tpmlib_state;
+
+use super::api::nvmem::NvRegion;
+use super::api::nvmem::NV_MEMORY_SIZE;
+use super::sparse;
+use super::MsTpm20PlatformState;
+use super::MsTpm20RefPlatform;
+use super::PLATFORM;
+
+const STREAM_MAGIC: [u8; 8] = *b"VTPMSTRM";
+const STREAM_VERSION: u32 = 1;
+const END_OF_ENTRIES: u32 = 0;
+
+/// Entry holding the NV region, in compact streams.
+///
+/// Never used as the id of a C library runtime variable.
+const NV_REGION_ENTRY_ID: u32 = u32::MAX;
+
+const ENTRY_FLAG_SPARSE: u8 = 1 << 0;
+
+/// Upper bound on the size of the serialized platform state
+const MAX_PLATFORM_STATE_LEN: usize = 1024 * 1024;
+
+fn read_u32(reader: &mut impl Read) -> Result<u32, Error> {
+    let mut buf = [0; 4];
+    reader.read_exact(&mut buf).map_err(Error::StateStreamIo)?;
+    Ok(u32::from_le_bytes(buf))
+}
+
+impl MsTpm20RefPlatform {
+    /// Save the TPM's state into `writer`, using the streaming saved state
+    /// format.
+    ///
+    /// The C library state is written directly into `writer`, variable by
+    /// variable, without being buffered. Note that calls into other TPM
+    /// instances will block until this method returns.
+    pub fn save_state_stream<W: Write>(&self, mut writer: W) -> Result<(), Error> {
+        let _engine = self.enter();
+        let mut platform = PLATFORM.try_lock().unwrap();
+        let platform = platform.as_mut().expect("platform is initialized");
+
+        let compact = platform.compact_saved_state;
+        let (platform_state, nv_region) = if compact {
+            platform.with_nv_region_detached(|state, nv_region| {
+                let state = postcard::to_stdvec(state).expect("failed to serialize state");
+                (state, Some(sparse::encode(nv_region)))
+            })
+        } else {
+            let state = postcard::to_stdvec(&platform.state).expect("failed to serialize state");
+            (state, None)
+        };
+
+        let mut write = |buf: &[u8]| writer.write_all(buf).map_err(Error::StateStreamIo);
+
+        write(&STREAM_MAGIC)?;
+        write(&STREAM_VERSION.to_le_bytes())?;
+        write(&tpmlib_state::implementation_fingerprint().to_le_bytes())?;
+        write(&(platform_state.len() as u32).to_le_bytes())?;
+        write(&platform_state)?;
+
+        let mut encoded = Vec::new();
+        for var in tpmlib_state::runtime_variables() {
+            // SAFETY: the engine lock is held, so the C library isn't running
+            let data = unsafe { var.as_slice() };
+            let (flags, data) = if compact {
+                encoded.clear();
+                sparse::encode_into(data, &mut encoded);
+                (ENTRY_FLAG_SPARSE, &encoded[..])
+            } else {
+                (0, data)
+            };
+
+            write(&var.id.to_le_bytes())?;
+            write(&[flags])?;
+            write(&(data.len() as u32).to_le_bytes())?;
+            write(data)?;
+        }
+
+        if let Some(nv_region) = nv_region {
+            write(&NV_REGION_ENTRY_ID.to_le_bytes())?;
+            write(&[ENTRY_FLAG_SPARSE])?;
+            write(&(nv_region.len() as u32).to_le_bytes())?;
+            write(&nv_region)?;
+        }
+
+        write(&END_OF_ENTRIES.to_le_bytes())?;
+
+        Ok(())
+    }
+
+    /// Restore the TPM's state from `reader`, using the streaming saved state
+    /// format.
+    ///
+    /// If an error is returned, the TPM's state is left unchanged.
+    pub fn restore_state_stream<R: Read>(&mut self, mut reader: R) -> Result<(), Error> {
+        let mut magic = [0; 8];
+        reader
+            .read_exact(&mut magic)
+            .map_err(Error::StateStreamIo)?;
+        if magic != STREAM_MAGIC || read_u32(&mut reader)? != STREAM_VERSION {
+            return Err(Error::InvalidRestoreFormat);
+        }
+
+        let mut fingerprint = [0; 8];
+        reader
+            .read_exact(&mut fingerprint)
+            .map_err(Error::StateStreamIo)?;
+        if u64::from_le_bytes(fingerprint) != tpmlib_state::implementation_fingerprint() {
+            return Err(Error::InvalidRestoreFormat);
+        }
+
+        let platform_state_len = read_u32(&mut reader)? as usize;
+        if platform_state_len > MAX_PLATFORM_STATE_LEN {
+            return Err(Error::InvalidRestoreSize);
+        }
+        let mut platform_state = vec![0; platform_state_len];
+        reader
+            .read_exact(&mut platform_state)
+            .map_err(Error::StateStreamIo)?;
+        let mut platform_state: MsTpm20PlatformState =
+            postcard::from_bytes(&platform_state).map_err(Error::FailedPlatformRestore)?;
+
+        let mut engine = self.enter();
+
+        let backup = engine.reset_resident_to_pristine();
+        let res = restore_runtime_variables(&mut reader).and_then(|nv_region| {
+            if let Some(nv_region) = nv_region {
+                platform_state.nvmem.region = NvRegion::Owned(nv_region);
+            }
+
+            PLATFORM
+                .try_lock()
+                .unwrap()
+                .as_mut()
+                .expect("platform is initialized")
+                .restore_runtime_state(platform_state)
+        });
+
+        match res {
+            Ok(()) => engine.spare = Some(backup),
+            Err(e) => {
+                engine.restore_resident_from(backup);
+                return Err(e);
+            }
+        }
+
+        Ok(())
+    }
+}
+
+fn read_entry_data(reader: &mut impl Read, len: usize, max_len: usize) -> Result<Vec<u8>, Error> {
+    if len > max_len {
+        return Err(Error::InvalidRestoreFormat);
+    }
+    let mut data = vec![0; len];
+    reader.read_exact(&mut data).map_err(Error::StateStreamIo)?;
+    Ok(data)
+}
+
+/// Restore the C library runtime variables from the stream's entries,
+/// returning the NV region if the stream contained one.
+fn restore_runtime_variables(reader: &mut impl Read) -> Result<Option<Vec<u8>>, Error> {
+    let vars = tpmlib_state::runtime_variables().collect::<Vec<_>>();
+    let mut nv_region = None;
+
+    loop {
+        let id = read_u32(reader)?;
+        if id == END_OF_ENTRIES {
+            break;
+        }
+
+        let mut flags = [0];
+        reader
+            .read_exact(&mut flags)
+            .map_err(Error::StateStreamIo)?;
+        if flags[0] & !ENTRY_FLAG_SPARSE != 0 {
+            return Err(Error::InvalidRestoreFormat);
+        }
+        let is_sparse = flags[0] & ENTRY_FLAG_SPARSE != 0;
+
+        let len = read_u32(reader)? as usize;
+
+        if id == NV_REGION_ENTRY_ID {
+            if !is_sparse {
+                return Err(Error::InvalidRestoreFormat);
+            }
+            let data = read_entry_data(reader, len, sparse::max_encoded_len(NV_MEMORY_SIZE))?;
+            nv_region = Some(sparse::decode(&data, NV_MEMORY_SIZE)?);
+            continue;
+        }
+
+        match vars.iter().find(|var| var.id == id) {
+            Some(var) if is_sparse => {
+                let data = read_entry_data(reader, len, sparse::max_encoded_len(var.len()))?;
+                // SAFETY: the engine lock is held, so the C library isn't
+                // running, and no other references to the variable exist.
+                let buf = unsafe { var.as_mut_slice() };
+                sparse::decode_into(&data, buf).map_err(|_| Error::InvalidRestoreFormat)?;
+            }
+            Some(var) if var.len() == len => {
+                // SAFETY: the engine lock is held, so the C library isn't
+                // running, and no other references to the variable exist.
+                let buf = unsafe { var.as_mut_slice() };
+                reader.read_exact(buf).map_err(Error::StateStreamIo)?;
+            }
+            // the variable's layout has changed
+            Some(_) => return Err(Error::InvalidRestoreFormat),
+            None => {
+                tracing::debug!("skipping unknown runtime variable {}", id);
+                let skipped = std::io::copy(&mut reader.take(len as u64), &mut std::io::sink())
+                    .map_err(Error::StateStreamIo)?;
+                if skipped != len as u64 {
+                    return Err(Error::StateStreamIo(
+                        std::io::ErrorKind::UnexpectedEof.into(),
+                    ));
+                }
+            }
+        }
+    }
+
+    Ok(nv_region)
+}
@@ -0,0 +1,745 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! A host-side resource manager, virtualizing the TPM's limited number of
+//! transient object and session slots.
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+
+use crate::Error;
+use crate::MsTpm20RefPlatform;
+
+const TPM_ST_NO_SESSIONS: u16 = 0x8001;
+const TPM_ST_SESSIONS: u16 = 0x8002;
+
+const TPM_CC_CHANGE_EPS: u32 = 0x124;
+const TPM_CC_CHANGE_PPS: u32 = 0x125;
+const TPM_CC_CLEAR: u32 = 0x126;
+const TPM_CC_HIERARCHY_CONTROL: u32 = 0x121;
+const TPM_CC_SEQUENCE_COMPLETE: u32 = 0x13e;
+const TPM_CC_STARTUP: u32 = 0x144;
+const TPM_CC_CONTEXT_LOAD: u32 = 0x161;
+const TPM_CC_CONTEXT_SAVE: u32 = 0x162;
+const TPM_CC_FLUSH_CONTEXT: u32 = 0x165;
+const TPM_CC_GET_CAPABILITY: u32 = 0x17a;
+const TPM_CC_EVENT_SEQUENCE_COMPLETE: u32 = 0x185;
+
+const TPM_RC_SUCCESS: u32 = 0x000;
+const TPM_RC_OBJECT_MEMORY: u32 = 0x902;
+const TPM_RC_SESSION_MEMORY: u32 = 0x903;
+const TPM_RC_REFERENCE_H0: u32 = 0x910;
+const TPM_RC_REFERENCE_S0: u32 = 0x918;
+
+const TPM_HT_HMAC_SESSION: u8 = 0x02;
+const TPM_HT_POLICY_SESSION: u8 = 0x03;
+const TPM_HT_TRANSIENT: u8 = 0x80;
+
+const TPM_CAP_HANDLES: u32 = 0x1;
+
+// TPMA_SESSION.continueSession
+const CONTINUE_SESSION: u8 = 0x01;
+
+const HEADER_SIZE: usize = 10;
+
+// comfortably larger than any TPMS_CONTEXT (or list of loaded handles) the
+// reference implementation produces
+const SCRATCH_SIZE: usize = 4096;
+
+/// Number of handles in the handle area of a command, and whether its
+/// response contains a handle, as per TPM 2.0 Part 3.
+///
+/// Returns `None` for commands unknown to the resource manager.
+fn command_handles(command_code: u32) -> Option<(usize, bool)> {
+    let handles = match command_code {
+        0x11f => (2, false), // NV_UndefineSpaceSpecial
+        0x120 => (2, false), // EvictControl
+        0x121 => (1, false), // HierarchyControl
+        0x122 => (2, false), // NV_UndefineSpace
+        0x124 => (1, false), // ChangeEPS
+        0x125 => (1, false), // ChangePPS
+        0x126 => (1, false), // Clear
+        0x127 => (1, false), // ClearControl
+        0x128 => (1, false), // ClockSet
+        0x129 => (1, false), // HierarchyChangeAuth
+        0x12a => (1, false), // NV_DefineSpace
+        0x12b => (1, false), // PCR_Allocate
+        0x12c => (1, false), // PCR_SetAuthPolicy
+        0x12d => (1, false), // PP_Commands
+        0x12e => (1, false), // SetPrimaryPolicy
+        0x12f => (2, false), // FieldUpgradeStart
+        0x130 => (1, false), // ClockRateAdjust
+        0x131 => (1, true),  // CreatePrimary
+        0x132 => (1, false), // NV_GlobalWriteLock
+        0x133 => (2, false), // GetCommandAuditDigest
+        0x134 => (2, false), // NV_Increment
+        0x135 => (2, false), // NV_SetBits
+        0x136 => (2, false), // NV_Extend
+        0x137 => (2, false), // NV_Write
+        0x138 => (2, false), // NV_WriteLock
+        0x139 => (1, false), // DictionaryAttackLockReset
+        0x13a => (1, false), // DictionaryAttackParameters
+        0x13b => (1, false), // NV_ChangeAuth
+        0x13c => (1, false), // PCR_Event
+        0x13d => (1, false), // PCR_Reset
+        0x13e => (1, false), // SequenceComplete
+        0x13f => (1, false), // SetAlgorithmSet
+        0x140 => (1, false), // SetCommandCodeAuditStatus
+        0x141 => (0, false), // FieldUpgradeData
+        0x142 => (0, false), // IncrementalSelfTest
+        0x143 => (0, false), // SelfTest
+        0x144 => (0, false), // Startup
+        0x145 => (0, false), // Shutdown
+        0x146 => (0, false), // StirRandom
+        0x147 => (2, false), // ActivateCredential
+        0x148 => (2, false), // Certify
+        0x149 => (3, false), // PolicyNV
+        0x14a => (2, false), // CertifyCreation
+        0x14b => (2, false), // Duplicate
+        0x14c => (2, false), // GetTime
+        0x14d => (3, false), // GetSessionAuditDigest
+        0x14e => (2, false), // NV_Read
+        0x14f => (2, false), // NV_ReadLock
+        0x150 => (2, false), // ObjectChangeAuth
+        0x151 => (2, false), // PolicySecret
+        0x152 => (2, false), // Rewrap
+        0x153 => (1, false), // Create
+        0x154 => (1, false), // ECDH_ZGen
+        0x155 => (1, false), // HMAC / MAC
+        0x156 => (1, false), // Import
+        0x157 => (1, true),  // Load
+        0x158 => (1, false), // Quote
+        0x159 => (1, false), // RSA_Decrypt
+        0x15b => (1, true),  // HMAC_Start / MAC_Start
+        0x15c => (1, false), // SequenceUpdate
+        0x15d => (1, false), // Sign
+        0x15e => (1, false), // Unseal
+        0x160 => (2, false), // PolicySigned
+        0x161 => (0, true),  // ContextLoad
+        0x162 => (1, false), // ContextSave
+        0x163 => (1, false), // ECDH_KeyGen
+        0x164 => (1, false), // EncryptDecrypt
+        0x165 => (0, false), // FlushContext
+        0x167 => (0, true),  // LoadExternal
+        0x168 => (1, false), // MakeCredential
+        0x169 => (1, false), // NV_ReadPublic
+        0x16a => (1, false), // PolicyAuthorize
+        0x16b => (1, false), // PolicyAuthValue
+        0x16c => (1, false), // PolicyCommandCode
+        0x16d => (1, false), // PolicyCounterTimer
+        0x16e => (1, false), // PolicyCpHash
+        0x16f => (1, false), // PolicyLocality
+        0x170 => (1, false), // PolicyNameHash
+        0x171 => (1, false), // PolicyOR
+        0x172 => (1, false), // PolicyTicket
+        0x173 => (1, false), // ReadPublic
+        0x174 => (1, false), // RSA_Encrypt
+        0x176 => (2, true),  // StartAuthSession
+        0x177 => (1, false), // VerifySignature
+        0x178 => (0, false), // ECC_Parameters
+        0x179 => (0, false), // FirmwareRead
+        0x17a => (0, false), // GetCapability
+        0x17b => (0, false), // GetRandom
+        0x17c => (0, false), // GetTestResult
+        0x17d => (0, false), // Hash
+        0x17e => (0, false), // PCR_Read
+        0x17f => (1, false), // PolicyPCR
+        0x180 => (1, false), // PolicyRestart
+        0x181 => (0, false), // ReadClock
+        0x182 => (1, false), // PCR_Extend
+        0x183 => (1, false), // PCR_SetAuthValue
+        0x184 => (3, false), // NV_Certify
+        0x185 => (2, false), // EventSequenceComplete
+        0x186 => (0, true),  // HashSequenceStart
+        0x187 => (1, false), // PolicyPhysicalPresence
+        0x188 => (1, false), // PolicyDuplicationSelect
+        0x189 => (1, false), // PolicyGetDigest
+        0x18a => (0, false), // TestParms
+        0x18b => (1, false), // Commit
+        0x18c => (1, false), // PolicyPassword
+        0x18d => (1, false), // ZGen_2Phase
+        0x18e => (0, false), // EC_Ephemeral
+        0x18f => (1, false), // PolicyNvWritten
+        0x190 => (1, false), // PolicyTemplate
+        0x191 => (1, true),  // CreateLoaded
+        0x192 => (3, false), // PolicyAuthorizeNV
+        0x193 => (1, false), // EncryptDecrypt2
+        0x194 => (1, false), // AC_GetCapability
+        0x195 => (3, false), // AC_Send
+        0x196 => (1, false), // Policy_AC_SendSelect
+        0x197 => (2, false), // CertifyX509
+        0x198 => (1, false), // ACT_SetTimeout
+        0x199 => (1, false), // ECC_Encrypt
+        0x19a => (1, false), // ECC_Decrypt
+        _ => return None,
+    };
+    Some(handles)
+}
+
+fn be_u16(buf: &[u8], offset: usize) -> Option<u16> {
+    let bytes = buf.get(offset..offset.checked_add(2)?)?;
+    Some(u16::from_be_bytes(bytes.try_into().unwrap()))
+}
+
+fn be_u32(buf: &[u8], offset: usize) -> Option<u32> {
+    let bytes = buf.get(offset..offset.checked_add(4)?)?;
+    Some(u32::from_be_bytes(bytes.try_into().unwrap()))
+}
+
+fn put_u32(buf: &mut [u8], offset: usize, val: u32) {
+    buf[offset..offset + 4].copy_from_slice(&val.to_be_bytes())
+}
+
+fn handle_type(handle: u32) -> u8 {
+    (handle >> 24) as u8
+}
+
+fn is_session(handle: u32) -> bool {
+    matches!(
+        handle_type(handle),
+        TPM_HT_HMAC_SESSION | TPM_HT_POLICY_SESSION
+    )
+}
+
+fn response_code(response: &[u8]) -> u32 {
+    be_u32(response, 6).unwrap_or(TPM_RC_SUCCESS)
+}
+
+/// Write a response consisting of only a header with the given response code.
+fn write_response(response: &mut [u8], rc: u32) -> Result<usize, Error> {
+    let response = response
+        .get_mut(..HEADER_SIZE)
+        .ok_or(Error::InvalidResponseSize)?;
+    response[0..2].copy_from_slice(&TPM_ST_NO_SESSIONS.to_be_bytes());
+    put_u32(response, 2, HEADER_SIZE as u32);
+    put_u32(response, 6, rc);
+    Ok(HEADER_SIZE)
+}
+
+/// The bits of a command the resource manager cares about.
+struct Command {
+    code: u32,
+    // (virtual) handles in the handle area
+    handles: Vec<u32>,
+    has_response_handle: bool,
+    // (handle, TPMA_SESSION) of each session in the authorization area
+    sessions: Vec<(u32, u8)>,
+    // handle being flushed by TPM2_FlushContext, which lives in the parameter
+    // area
+    flush_handle: Option<u32>,
+}
+
+impl Command {
+    /// Returns `None` if the command is malformed, or unknown to the resource
+    /// manager.
+    fn parse(request: &[u8]) -> Option<Command> {
+        let tag = be_u16(request, 0)?;
+        let code = be_u32(request, 6)?;
+        let (num_handles, has_response_handle) = command_handles(code)?;
+
+        let handles = (0..num_handles)
+            .map(|i| be_u32(request, HEADER_SIZE + i * 4))
+            .collect::<Option<Vec<_>>>()?;
+
+        let mut sessions = Vec::new();
+        match tag {
+            TPM_ST_NO_SESSIONS => {}
+            TPM_ST_SESSIONS => {
+                let mut offset = HEADER_SIZE + num_handles * 4;
+                let auth_size = be_u32(request, offset)? as usize;
+                offset += 4;
+                let end = offset.checked_add(auth_size)?;
+                while offset < end {
+                    let handle = be_u32(request, offset)?;
+                    offset += 4;
+                    let nonce_size = be_u16(request, offset)? as usize;
+                    offset += 2 + nonce_size;
+                    let attributes = *request.get(offset)?;
+                    offset += 1;
+                    let hmac_size = be_u16(request, offset)? as usize;
+                    offset += 2 + hmac_size;
+                    sessions.push((handle, attributes));
+                }
+                if offset != end || end > request.len() {
+                    return None;
+                }
+            }
+            _ => return None,
+        }
+
+        let flush_handle = match code {
+            TPM_CC_FLUSH_CONTEXT => Some(be_u32(request, HEADER_SIZE)?),
+            _ => None,
+        };
+
+        Some(Command {
+            code,
+            handles,
+            has_response_handle,
+            sessions,
+            flush_handle,
+        })
+    }
+
+    fn references(&self, handle: u32) -> bool {
+        self.handles.contains(&handle) || self.sessions.iter().any(|&(h, _)| h == handle)
+    }
+}
+
+enum ObjectResidency {
+    /// Loaded into the TPM at the given handle.
+    Loaded(u32),
+    /// Evicted into host memory, as a saved context.
+    Evicted(Vec<u8>),
+}
+
+struct Object {
+    residency: ObjectResidency,
+    last_used: u64,
+}
+
+enum SessionResidency {
+    Loaded,
+    /// Evicted into host memory, as a saved context.
+    Evicted(Vec<u8>),
+    /// Context saved by the client, who is responsible for loading it again.
+    SavedByClient,
+}
+
+struct Session {
+    residency: SessionResidency,
+    last_used: u64,
+}
+
+/// A resource manager sitting in front of a TPM instance, which transparently
+/// virtualizes the TPM's transient object and session slots.
+///
+/// The TPM library only has room for a handful of loaded objects and sessions
+/// at any given time, and clients would ordinarily have to juggle them using
+/// explicit `TPM2_ContextSave` / `TPM2_ContextLoad` / `TPM2_FlushContext`
+/// round trips. When running commands through a `ResourceManager`, clients
+/// can instead use as many objects and sessions as they like:
+///
+/// - Transient objects are handed out virtual handles, which remain stable
+///   for the lifetime of the object.
+/// - Objects and sessions stay loaded in the TPM until a command fails for
+///   lack of space, at which point the least-recently-used objects / sessions
+///   that the command doesn't reference are evicted into host memory, and the
+///   command is retried (using a copy of the request, as the TPM decrypts
+///   session-encrypted parameters in place).
+/// - Evicted objects and sessions are transparently loaded back in when
+///   referenced by a subsequent command.
+///
+/// Since nothing is evicted until the TPM actually runs out of space, clients
+/// which stay within the TPM's limits incur no additional overhead.
+///
+/// All commands for the instance must be sent through the resource manager.
+/// Transient handles reported by `TPM2_GetCapability` are _not_ virtualized.
+pub struct ResourceManager {
+    platform: MsTpm20RefPlatform,
+    objects: HashMap<u32, Object>,
+    sessions: HashMap<u32, Session>,
+    next_handle: u32,
+    tick: u64,
+    request_scratch: Vec<u8>,
+    response_scratch: Vec<u8>,
+    retry_request: Vec<u8>,
+}
+
+impl std::fmt::Debug for ResourceManager {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("ResourceManager")
+            .field("platform", &self.platform)
+            .finish_non_exhaustive()
+    }
+}
+
+impl ResourceManager {
+    /// Create a new resource manager for the given TPM instance.
+    ///
+    /// Any objects or sessions loaded into the instance at this point are not
+    /// managed by the resource manager.
+    pub fn new(platform: MsTpm20RefPlatform) -> ResourceManager {
+        ResourceManager {
+            platform,
+            objects: HashMap::new(),
+            sessions: HashMap::new(),
+            next_handle: 0,
+            tick: 0,
+            request_scratch: Vec::with_capacity(SCRATCH_SIZE),
+            response_scratch: vec![0; SCRATCH_SIZE],
+            retry_request: Vec::new(),
+        }
+    }
+
+    /// Access the underlying TPM instance.
+    pub fn platform(&self) -> &MsTpm20RefPlatform {
+        &self.platform
+    }
+
+    /// Return the underlying TPM instance, invalidating any virtual handles
+    /// handed out by the resource manager.
+    pub fn into_inner(self) -> MsTpm20RefPlatform {
+        self.platform
+    }
+
+    /// Reset the TPM device, as per [`MsTpm20RefPlatform::reset`].
+    ///
+    /// All transient objects and sessions are lost across a reset, so this
+    /// also invalidates any virtual handles handed out by the resource manager.
+    pub fn reset(&mut self, with_new_nvmem_blob: Option<&[u8]>) -> Result<(), Error> {
+        self.objects.clear();
+        self.sessions.clear();
+        self.platform.reset(with_new_nvmem_blob)
+    }
+
+    /// Execute a command on the TPM, translating any virtual handles it
+    /// references.
+    ///
+    /// In addition to the validation performed by
+    /// [`MsTpm20RefPlatform::execute_command`], the response buffer must be
+    /// able to hold at least a response header.
+    pub fn execute_command(
+        &mut self,
+        request: &mut [u8],
+        response: &mut [u8],
+    ) -> Result<usize, Error> {
+        let command = match Command::parse(request) {
+            Some(command) => command,
+            None => return self.platform.execute_command(request, response),
+        };
+
+        self.tick += 1;
+
+        let mut flushed_object = None;
+        if let Some(handle) = command.flush_handle {
+            match self.objects.get(&handle).map(|o| &o.residency) {
+                Some(ObjectResidency::Loaded(physical)) => {
+                    put_u32(request, HEADER_SIZE, *physical);
+                    flushed_object = Some(handle);
+                }
+                // nothing to flush from the TPM itself
+                Some(ObjectResidency::Evicted(_)) => {
+                    self.objects.remove(&handle);
+                    return write_response(response, TPM_RC_SUCCESS);
+                }
+                None => {}
+            }
+        }
+
+        // load (and pin) everything the command references
+        for (i, &handle) in command.handles.iter().enumerate() {
+            if handle_type(handle) == TPM_HT_TRANSIENT && self.objects.contains_key(&handle) {
+                match self.load_object(handle, &command)? {
+                    Ok(physical) => put_u32(request, HEADER_SIZE + i * 4, physical),
+                    Err(()) => return write_response(response, TPM_RC_REFERENCE_H0 + i as u32),
+                }
+            } else if self.sessions.contains_key(&handle) {
+                if self.load_session(handle, &command)?.is_err() {
+                    return write_response(response, TPM_RC_REFERENCE_H0 + i as u32);
+                }
+            }
+        }
+        for (i, &(handle, _)) in command.sessions.iter().enumerate() {
+            if self.sessions.contains_key(&handle) && self.load_session(handle, &command)?.is_err()
+            {
+                return write_response(response, TPM_RC_REFERENCE_S0 + i as u32);
+            }
+        }
+
+        // Commands such as CreatePrimary / Load only run out of slots in their
+        // action code, by which point the TPM has already decrypted any
+        // session-encrypted parameters in place. Retries must therefore be
+        // made with the request as it was originally sent.
+        self.retry_request.clear();
+        self.retry_request.extend_from_slice(request);
+
+        let response_len = loop {
+            let response_len = self.platform.execute_command(request, response)?;
+            let evicted = match response_code(response) {
+                TPM_RC_OBJECT_MEMORY => self.evict_object(&command)?,
+                TPM_RC_SESSION_MEMORY => self.evict_session(&command)?,
+                _ => false,
+            };
+            if !evicted {
+                break response_len;
+            }
+            request.copy_from_slice(&self.retry_request);
+        };
+
+        if response_code(response) != TPM_RC_SUCCESS {
+            return Ok(response_len);
+        }
+
+        self.command_completed(&command, flushed_object, &mut response[..response_len])?;
+
+        Ok(response_len)
+    }
+
+    /// Update the resource manager's bookkeeping after a command completed
+    /// successfully.
+    fn command_completed(
+        &mut self,
+        command: &Command,
+        flushed_object: Option<u32>,
+        response: &mut [u8],
+    ) -> Result<(), Error> {
+        match command.code {
+            // all transient objects and sessions are flushed on startup
+            TPM_CC_STARTUP => {
+                self.objects.clear();
+                self.sessions.clear();
+            }
+            TPM_CC_FLUSH_CONTEXT => {
+                if let Some(handle) = flushed_object {
+                    self.objects.remove(&handle);
+                } else if let Some(handle) = command.flush_handle {
+                    self.sessions.remove(&handle);
+                }
+            }
+            TPM_CC_CONTEXT_SAVE => {
+                if let Some(session) = self.sessions.get_mut(&command.handles[0]) {
+                    session.residency = SessionResidency::SavedByClient;
+                }
+            }
+            // sequence objects are flushed once the sequence completes
+            TPM_CC_SEQUENCE_COMPLETE => {
+                self.objects.remove(&command.handles[0]);
+            }
+            TPM_CC_EVENT_SEQUENCE_COMPLETE => {
+                self.objects.remove(&command.handles[1]);
+            }
+            // these may flush any number of loaded objects
+            TPM_CC_CHANGE_EPS | TPM_CC_CHANGE_PPS | TPM_CC_CLEAR | TPM_CC_HIERARCHY_CONTROL => {
+                self.sync_loaded_objects()?;
+            }
+            _ => {}
+        }
+
+        // with continueSession clear, sessions are flushed once the command
+        // completes
+        for &(handle, attributes) in &command.sessions {
+            if attributes & CONTINUE_SESSION == 0 {
+                self.sessions.remove(&handle);
+            }
+        }
+
+        if command.has_response_handle {
+            if let Some(handle) = be_u32(response, HEADER_SIZE) {
+                if handle_type(handle) == TPM_HT_TRANSIENT {
+                    let virtual_handle = self.allocate_handle();
+                    self.objects.insert(
+                        virtual_handle,
+                        Object {
+                            residency: ObjectResidency::Loaded(handle),
+                            last_used: self.tick,
+                        },
+                    );
+                    put_u32(response, HEADER_SIZE, virtual_handle);
+                } else if is_session(handle) {
+                    self.sessions.insert(
+                        handle,
+                        Session {
+                            residency: SessionResidency::Loaded,
+                            last_used: self.tick,
+                        },
+                    );
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    fn allocate_handle(&mut self) -> u32 {
+        loop {
+            let handle = (TPM_HT_TRANSIENT as u32) << 24 | (self.next_handle & 0x00ff_ffff);
+            self.next_handle = self.next_handle.wrapping_add(1);
+            if !self.objects.contains_key(&handle) {
+                return handle;
+            }
+        }
+    }
+
+    /// Execute a command generated by the resource manager itself, returning
+    /// its response code. The response is left in `response_scratch`.
+    fn transact(&mut self, code: u32, params: impl FnOnce(&mut Vec<u8>)) -> Result<u32, Error> {
+        let request = &mut self.request_scratch;
+        request.clear();
+        request.extend_from_slice(&TPM_ST_NO_SESSIONS.to_be_bytes());
+        request.extend_from_slice(&[0; 4]);
+        request.extend_from_slice(&code.to_be_bytes());
+        params(request);
+        let size = request.len() as u32;
+        put_u32(request, 2, size);
+
+        self.platform
+            .execute_command(&mut self.request_scratch, &mut self.response_scratch)?;
+        Ok(response_code(&self.response_scratch))
+    }
+
+    /// Save the context of the given loaded object or session.
+    fn context_save(&mut self, handle: u32) -> Result<Option<Vec<u8>>, Error> {
+        let rc = self.transact(TPM_CC_CONTEXT_SAVE, |req| {
+            req.extend_from_slice(&handle.to_be_bytes())
+        })?;
+        if rc != TPM_RC_SUCCESS {
+            return Ok(None);
+        }
+        let size = be_u32(&self.response_scratch, 2).unwrap_or(0) as usize;
+        Ok(Some(self.response_scratch[HEADER_SIZE..size].to_vec()))
+    }
+
+    /// Load a previously saved context, making room for it if required.
+    ///
+    /// Returns the handle it was loaded at, or `None` if the context could not
+    /// be loaded.
+    fn context_load(&mut self, context: &[u8], command: &Command) -> Result<Option<u32>, Error> {
+        loop {
+            let rc = self.transact(TPM_CC_CONTEXT_LOAD, |req| req.extend_from_slice(context))?;
+            let evicted = match rc {
+                TPM_RC_SUCCESS => return Ok(be_u32(&self.response_scratch, HEADER_SIZE)),
+                TPM_RC_OBJECT_MEMORY => self.evict_object(command)?,
+                TPM_RC_SESSION_MEMORY => self.evict_session(command)?,
+                _ => false,
+            };
+            if !evicted {
+                tracing::debug!(rc, "failed to reload evicted context");
+                return Ok(None);
+            }
+        }
+    }
+
+    /// Make sure the given object is loaded, returning the handle it's loaded
+    /// at (or `Err` if it could not be reloaded, and is no longer available).
+    fn load_object(&mut self, handle: u32, command: &Command) -> Result<Result<u32, ()>, Error> {
+        let object = self.objects.get_mut(&handle).unwrap();
+        object.last_used = self.tick;
+        let context = match &mut object.residency {
+            ObjectResidency::Loaded(physical) => return Ok(Ok(*physical)),
+            ObjectResidency::Evicted(context) => std::mem::take(context),
+        };
+
+        match self.context_load(&context, command)? {
+            Some(physical) => {
+                self.objects.get_mut(&handle).unwrap().residency =
+                    ObjectResidency::Loaded(physical);
+                Ok(Ok(physical))
+            }
+            None => {
+                self.objects.remove(&handle);
+                Ok(Err(()))
+            }
+        }
+    }
+
+    /// Make sure the given session is loaded (or `Err` if it could not be
+    /// reloaded, and is no longer available).
+    fn load_session(&mut self, handle: u32, command: &Command) -> Result<Result<(), ()>, Error> {
+        let session = self.sessions.get_mut(&handle).unwrap();
+        session.last_used = self.tick;
+        let context = match &mut session.residency {
+            SessionResidency::Loaded | SessionResidency::SavedByClient => return Ok(Ok(())),
+            SessionResidency::Evicted(context) => std::mem::take(context),
+        };
+
+        match self.context_load(&context, command)? {
+            Some(_) => {
+                self.sessions.get_mut(&handle).unwrap().residency = SessionResidency::Loaded;
+                Ok(Ok(()))
+            }
+            None => {
+                self.sessions.remove(&handle);
+                Ok(Err(()))
+            }
+        }
+    }
+
+    /// Evict the least-recently-used loaded object which isn't referenced by
+    /// `command`, returning `false` if there was nothing to evict.
+    fn evict_object(&mut self, command: &Command) -> Result<bool, Error> {
+        let mut candidates = (self.objects.iter())
+            .filter_map(|(&handle, object)| match object.residency {
+                ObjectResidency::Loaded(physical) if !command.references(handle) => {
+                    Some((object.last_used, handle, physical))
+                }
+                _ => None,
+            })
+            .collect::<Vec<_>>();
+        candidates.sort_unstable();
+
+        for (_, handle, physical) in candidates {
+            let context = match self.context_save(physical)? {
+                Some(context) => context,
+                None => continue,
+            };
+            let rc = self.transact(TPM_CC_FLUSH_CONTEXT, |req| {
+                req.extend_from_slice(&physical.to_be_bytes())
+            })?;
+            if rc != TPM_RC_SUCCESS {
+                continue;
+            }
+
+            tracing::trace!(handle, "evicted object");
+            self.objects.get_mut(&handle).unwrap().residency = ObjectResidency::Evicted(context);
+            return Ok(true);
+        }
+
+        Ok(false)
+    }
+
+    /// Evict the least-recently-used loaded session which isn't referenced by
+    /// `command`, returning `false` if there was nothing to evict.
+    fn evict_session(&mut self, command: &Command) -> Result<bool, Error> {
+        let mut candidates = (self.sessions.iter())
+            .filter_map(|(&handle, session)| match session.residency {
+                SessionResidency::Loaded if !command.references(handle) => {
+                    Some((session.last_used, handle))
+                }
+                _ => None,
+            })
+            .collect::<Vec<_>>();
+        candidates.sort_unstable();
+
+        for (_, handle) in candidates {
+            // saving a session's context also frees up its slot
+            if let Some(context) = self.context_save(handle)? {
+                tracing::trace!(handle, "evicted session");
+                self.sessions.get_mut(&handle).unwrap().residency =
+                    SessionResidency::Evicted(context);
+                return Ok(true);
+            }
+        }
+
+        Ok(false)
+    }
+
+    /// Forget about any loaded objects which the TPM has flushed behind the
+    /// resource manager's back, before their slots get re-used.
+    fn sync_loaded_objects(&mut self) -> Result<(), Error> {
+        const MAX_HANDLES: u32 = 64;
+
+        let rc = self.transact(TPM_CC_GET_CAPABILITY, |req| {
+            req.extend_from_slice(&TPM_CAP_HANDLES.to_be_bytes());
+            req.extend_from_slice(&((TPM_HT_TRANSIENT as u32) << 24).to_be_bytes());
+            req.extend_from_slice(&MAX_HANDLES.to_be_bytes());
+        })?;
+        if rc != TPM_RC_SUCCESS {
+            tracing::warn!(rc, "failed to query loaded transient objects");
+            return Ok(());
+        }
+
+        // TPMI_YES_NO moreData, TPM_CAP capability, TPML_HANDLE handles
+        let response = &self.response_scratch;
+        let count = be_u32(response, HEADER_SIZE + 5).unwrap_or(0) as usize;
+        let loaded = (0..count)
+            .filter_map(|i| be_u32(response, HEADER_SIZE + 9 + i * 4))
+            .collect::<Vec<_>>();
+
+        self.objects.retain(|_, object| match object.residency {
+            ObjectResidency::Loaded(physical) => loaded.contains(&physical),
+            ObjectResidency::Evicted(_) => true,
+        });
+
+        Ok(())
+    }
+}
@@ -4,6 +4,7 @@
 //! of TPM C library state.
 
 use crate::error::Error;
+use once_cell::sync::Lazy;
 use serde::Deserialize;
 use serde::Serialize;
 
@@ -21,6 +22,31 @@ extern "C" {
     // - 2 for size mismatch
     // - 3 for format validation error
     pub fn INJECTED_ApplyRuntimeState(pBuffer: *const u8, pBufferSize: u32) -> i32;
+
+    pub fn INJECTED_GetRuntimeArenaSize() -> u32;
+
+    pub fn INJECTED_GetImplementationFingerprint() -> u64;
+
+    pub fn INJECTED_GetRuntimeVariableCount() -> u32;
+
+    // Returns:
+    // - 0 on success
+    // - 1 for invalid arg
+    pub fn INJECTED_GetRuntimeVariable(
+        index: u32,
+        pId: *mut u32,
+        ppVariable: *mut *mut u8,
+        pSize: *mut u32,
+    ) -> i32;
+
+    // Returns:
+    // - 0 on success
+    // - 1 for invalid arg
+    pub fn INJECTED_SwapRuntimeState(
+        pSaveArena: *mut u8,
+        pLoadArena: *const u8,
+        arenaSize: u32,
+    ) -> i32;
 }
 
 #[derive(Clone, Serialize, Deserialize)]
@@ -28,7 +54,17 @@ pub struct MsTpm20RefLibraryState {
     opaque: Vec<u8>,
 }
 
-pub fn get_runtime_state() -> MsTpm20RefLibraryState {
+impl MsTpm20RefLibraryState {
+    pub fn from_bytes(opaque: Vec<u8>) -> MsTpm20RefLibraryState {
+        MsTpm20RefLibraryState { opaque }
+    }
+
+    pub fn into_bytes(self) -> Vec<u8> {
+        self.opaque
+    }
+}
+
+static RUNTIME_STATE_SIZE: Lazy<usize> = Lazy::new(|| {
     let mut size: u32 = 0;
     // SAFETY: passing a nullptr returns the required size
     let ret = unsafe { INJECTED_GetRuntimeState(std::ptr::null_mut(), &mut size) };
@@ -36,17 +72,35 @@ pub fn get_runtime_state() -> MsTpm20RefLibraryState {
     assert_eq!(ret, 2);
     assert_ne!(size, 0);
 
+    size as usize
+});
+
+/// Size of the opaque runtime state blob.
+pub fn runtime_state_size() -> usize {
+    *RUNTIME_STATE_SIZE
+}
+
+pub fn get_runtime_state() -> MsTpm20RefLibraryState {
     let mut state = MsTpm20RefLibraryState {
-        opaque: vec![0; size as usize],
+        opaque: vec![0; runtime_state_size()],
     };
 
+    get_runtime_state_into(&mut state.opaque);
+
+    state
+}
+
+/// Write the opaque runtime state blob into `buf`, which must be exactly
+/// [`runtime_state_size`] bytes long.
+pub fn get_runtime_state_into(buf: &mut [u8]) {
+    assert_eq!(buf.len(), runtime_state_size());
+
+    let mut size = buf.len() as u32;
     // SAFETY: passing in pointer + size corresponding to perfectly-sized buffer
-    // (as per previous call)
-    let ret = unsafe { INJECTED_GetRuntimeState(state.opaque.as_mut_ptr(), &mut size) };
+    // (as per the cached size query)
+    let ret = unsafe { INJECTED_GetRuntimeState(buf.as_mut_ptr(), &mut size) };
 
     assert_eq!(ret, 0);
-
-    state
 }
 
 pub fn restore_runtime_state(state: MsTpm20RefLibraryState) -> Result<(), Error> {
@@ -62,3 +116,141 @@ pub fn restore_runtime_state(state: MsTpm20RefLibraryState) -> Result<(), Error>
         _ => unreachable!(),
     }
 }
+
+#[derive(Clone, Copy)]
+#[repr(C, align(64))]
+struct ArenaLine([u8; 64]);
+
+static ARENA_LINES: Lazy<usize> = Lazy::new(|| {
+    // SAFETY: INJECTED_GetRuntimeArenaSize doesn't have any preconditions
+    let size = unsafe { INJECTED_GetRuntimeArenaSize() } as usize;
+    size.div_ceil(std::mem::size_of::<ArenaLine>())
+});
+
+/// Host-memory backing for the runtime state of a parked (i.e: not currently
+/// resident) TPM instance.
+///
+/// Unlike [`MsTpm20RefLibraryState`], arenas are not validated or serialized
+/// in any way, and can only be swapped in and out of the C library.
+pub struct RuntimeArena {
+    lines: Vec<ArenaLine>,
+}
+
+impl RuntimeArena {
+    pub fn new() -> RuntimeArena {
+        RuntimeArena {
+            lines: vec![ArenaLine([0; 64]); *ARENA_LINES],
+        }
+    }
+
+    fn size(&self) -> u32 {
+        (self.lines.len() * std::mem::size_of::<ArenaLine>()) as u32
+    }
+
+    /// Zero the arena, which may contain secrets (e.g: seeds, or loaded keys)
+    /// belonging to the instance whose state it last held.
+    pub fn clear(&mut self) {
+        for line in &mut self.lines {
+            // SAFETY: `line` is a valid, aligned, exclusive reference. Volatile
+            // writes ensure the zeroing isn't elided ahead of deallocation.
+            unsafe { std::ptr::write_volatile(line, ArenaLine([0; 64])) };
+        }
+        std::sync::atomic::compiler_fence(std::sync::atomic::Ordering::SeqCst);
+    }
+}
+
+impl Drop for RuntimeArena {
+    fn drop(&mut self) {
+        self.clear();
+    }
+}
+
+/// Save the live runtime state into `save` (discarding it if None), and
+/// replace it with the contents of `load` (leaving it as-is if None).
+pub fn swap_runtime_state(save: Option<&mut RuntimeArena>, load: Option<&RuntimeArena>) {
+    let size = *ARENA_LINES as u32 * std::mem::size_of::<ArenaLine>() as u32;
+    let save = match save {
+        Some(arena) => {
+            assert_eq!(arena.size(), size);
+            arena.lines.as_mut_ptr() as *mut u8
+        }
+        None => std::ptr::null_mut(),
+    };
+    let load = match load {
+        Some(arena) => {
+            assert_eq!(arena.size(), size);
+            arena.lines.as_ptr() as *const u8
+        }
+        None => std::ptr::null(),
+    };
+
+    // SAFETY: both arenas are either null, or are distinct Rust allocations of
+    // the required size.
+    let ret = unsafe { INJECTED_SwapRuntimeState(save, load, size) };
+
+    assert_eq!(ret, 0);
+}
+
+/// Fingerprint of the build-time choices which determine the layout of the
+/// runtime variables.
+pub fn implementation_fingerprint() -> u64 {
+    // SAFETY: INJECTED_GetImplementationFingerprint doesn't have any
+    // preconditions
+    unsafe { INJECTED_GetImplementationFingerprint() }
+}
+
+/// A single runtime variable of the C library.
+#[derive(Clone, Copy)]
+pub struct RuntimeVariable {
+    /// Stable identifier for the variable
+    pub id: u32,
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl RuntimeVariable {
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// # Safety
+    ///
+    /// Callers must ensure that the C library is not running, and that no
+    /// mutable reference to the variable is live.
+    pub unsafe fn as_slice<'a>(&self) -> &'a [u8] {
+        // SAFETY: C library guarantees ptr + len point to a live global
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+
+    /// # Safety
+    ///
+    /// Callers must ensure that the C library is not running, and that no
+    /// other reference to the variable is live.
+    #[allow(clippy::mut_from_ref)]
+    pub unsafe fn as_mut_slice<'a>(&self) -> &'a mut [u8] {
+        // SAFETY: C library guarantees ptr + len point to a live global
+        unsafe { std::slice::from_raw_parts_mut(self.ptr, self.len) }
+    }
+}
+
+/// Enumerate all runtime variables of the C library.
+pub fn runtime_variables() -> impl Iterator<Item = RuntimeVariable> {
+    // SAFETY: INJECTED_GetRuntimeVariableCount doesn't have any preconditions
+    let count = unsafe { INJECTED_GetRuntimeVariableCount() };
+
+    (0..count).map(|index| {
+        let mut id = 0;
+        let mut ptr = std::ptr::null_mut();
+        let mut size = 0;
+        // SAFETY: index is in range, and all out-params are valid pointers
+        let ret = unsafe { INJECTED_GetRuntimeVariable(index, &mut id, &mut ptr, &mut size) };
+
+        assert_eq!(ret, 0);
+
+        RuntimeVariable {
+            id,
+            ptr,
+            len: size as usize,
+        }
+    })
+}
@@ -0,0 +1,289 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! End-to-end benchmarks of common TPM operations, driven through
+//! `MsTpm20RefPlatform`.
+//!
+//! Run with `cargo bench -p test-harness`, optionally followed by `-- <filter>`
+//! to only run benchmarks whose name contains `<filter>`.
+
+#[path = "../tests/common/mod.rs"]
+mod common;
+
+use common::*;
+use std::convert::TryInto;
+use std::hint::black_box;
+use std::time::Duration;
+use std::time::Instant;
+
+// OWNERWRITE | AUTHWRITE | OWNERREAD | AUTHREAD | NO_DA
+const NV_INDEX_ATTRIBUTES: u32 = 0x0206_0006;
+const NV_INDEX: u32 = 0x0100_0000;
+const NV_INDEX_SIZE: u16 = 256;
+
+const PCR_INDEX: u32 = 0;
+
+/// Minimum wall time of a single sample, which is made up of as many
+/// iterations as fit.
+const SAMPLE_TIME: Duration = Duration::from_millis(10);
+const DEFAULT_SAMPLES: usize = 50;
+
+/// Minimal benchmark runner, reporting the mean and median time per iteration
+/// across a number of samples.
+struct Bencher {
+    filter: Option<String>,
+}
+
+impl Bencher {
+    fn from_args() -> Bencher {
+        // cargo passes `--bench`, alongside anything following `--`
+        Bencher {
+            filter: std::env::args().skip(1).find(|arg| !arg.starts_with("--")),
+        }
+    }
+
+    fn bench(&self, name: &str, samples: usize, mut f: impl FnMut()) {
+        self.bench_batched(name, samples, || (), |()| f())
+    }
+
+    /// Benchmark `routine`, excluding the time taken by `setup` to create each
+    /// of its inputs.
+    fn bench_batched<I>(
+        &self,
+        name: &str,
+        samples: usize,
+        mut setup: impl FnMut() -> I,
+        mut routine: impl FnMut(I),
+    ) {
+        if let Some(filter) = &self.filter {
+            if !name.contains(filter.as_str()) {
+                return;
+            }
+        }
+
+        let mut time = |iters: u32| {
+            let inputs = (0..iters).map(|_| setup()).collect::<Vec<_>>();
+            let start = Instant::now();
+            for input in inputs {
+                routine(input);
+            }
+            start.elapsed()
+        };
+
+        // warm up, and size samples to take at least SAMPLE_TIME
+        let once = time(1).max(Duration::from_nanos(1));
+        let iters = (SAMPLE_TIME.as_nanos() / once.as_nanos()).clamp(1, 1 << 20) as u32;
+
+        let mut per_iter = (0..samples)
+            .map(|_| time(iters) / iters)
+            .collect::<Vec<_>>();
+        per_iter.sort_unstable();
+        let mean = per_iter.iter().sum::<Duration>() / samples as u32;
+        let median = per_iter[samples / 2];
+
+        println!(
+            "{:<32} mean: {:>12?}  median: {:>12?}  ({} x {} iterations)",
+            name, mean, median, samples, iters
+        );
+    }
+}
+
+fn bench_startup(b: &Bencher) {
+    b.bench("cold_init_and_startup", DEFAULT_SAMPLES, || {
+        black_box(Tpm::new());
+    });
+}
+
+fn bench_get_random(b: &Bencher) {
+    let mut tpm = Tpm::new();
+    let cmd = Command::new(TPM_ST_NO_SESSIONS, TPM_CC_GET_RANDOM)
+        .u16(32)
+        .finish();
+    b.bench("get_random_32", DEFAULT_SAMPLES, || {
+        black_box(tpm.run(&cmd).len());
+    });
+}
+
+fn pcr_extend_params() -> Vec<u8> {
+    Command::params()
+        .u32(1)
+        .u16(TPM_ALG_SHA256)
+        .bytes(&[0xa5; 32])
+        .take()
+}
+
+fn bench_pcr_extend(b: &Bencher) {
+    let mut tpm = Tpm::new();
+    let cmd = Command::new(TPM_ST_SESSIONS, TPM_CC_PCR_EXTEND)
+        .u32(PCR_INDEX)
+        .pw_auth()
+        .bytes(&pcr_extend_params())
+        .finish();
+    b.bench("pcr_extend_sha256", DEFAULT_SAMPLES, || {
+        black_box(tpm.run(&cmd).len());
+    });
+}
+
+fn bench_create_primary(b: &Bencher) {
+    let mut tpm = Tpm::new();
+    for (name, cmd, samples) in [
+        // RSA key generation is slow, and has a high variance
+        ("create_primary/rsa2048", create_primary(rsa2048_public), 10),
+        (
+            "create_primary/ecc_p256",
+            create_primary(ecc_p256_public),
+            DEFAULT_SAMPLES,
+        ),
+    ] {
+        b.bench(name, samples, || {
+            let handle = tpm.run_for_handle(&cmd);
+            tpm.flush(handle);
+        });
+    }
+}
+
+fn bench_sign_verify(b: &Bencher) {
+    let mut tpm = Tpm::new();
+    let key = tpm.run_for_handle(&create_primary(ecc_p256_public));
+    let digest = [0x5a; 32];
+
+    let sign = Command::new(TPM_ST_SESSIONS, TPM_CC_SIGN)
+        .u32(key)
+        .pw_auth()
+        .tpm2b(&digest)
+        .u16(TPM_ALG_ECDSA)
+        .u16(TPM_ALG_SHA256)
+        // null hashcheck ticket
+        .u16(TPM_ST_HASHCHECK)
+        .u32(TPM_RH_NULL)
+        .tpm2b(&[])
+        .finish();
+
+    // response: header, parameterSize, TPMT_SIGNATURE, auth area
+    let signature = {
+        let res = tpm.run(&sign);
+        let param_size = u32::from_be_bytes(res[10..14].try_into().unwrap()) as usize;
+        res[14..14 + param_size].to_vec()
+    };
+    let verify = Command::new(TPM_ST_NO_SESSIONS, TPM_CC_VERIFY_SIGNATURE)
+        .u32(key)
+        .tpm2b(&digest)
+        .bytes(&signature)
+        .finish();
+
+    b.bench("ecc_p256/sign", DEFAULT_SAMPLES, || {
+        black_box(tpm.run(&sign).len());
+    });
+    b.bench("ecc_p256/verify", DEFAULT_SAMPLES, || {
+        black_box(tpm.run(&verify).len());
+    });
+}
+
+fn bench_hmac_session(b: &Bencher) {
+    let mut tpm = Tpm::new();
+    b.bench("hmac_session/start_flush", DEFAULT_SAMPLES, || {
+        let session = HmacSession::start(&mut tpm);
+        tpm.flush(session.handle);
+    });
+
+    // the same PCR_Extend as `pcr_extend_sha256`, authorized through an HMAC
+    // session instead of a password. Includes the time taken to compute the
+    // command HMAC, as any client would have to.
+    let mut session = HmacSession::start(&mut tpm);
+    let params = pcr_extend_params();
+    b.bench("hmac_session/pcr_extend_sha256", DEFAULT_SAMPLES, || {
+        let auth = session.auth_area(
+            TPM_CC_PCR_EXTEND,
+            &[&PCR_INDEX.to_be_bytes()],
+            &params,
+            CONTINUE_SESSION,
+        );
+        let res = tpm.run(
+            &Command::new(TPM_ST_SESSIONS, TPM_CC_PCR_EXTEND)
+                .u32(PCR_INDEX)
+                .bytes(&auth)
+                .bytes(&params)
+                .finish(),
+        );
+        session.update(res, 0);
+    });
+}
+
+fn bench_nv(b: &Bencher) {
+    let mut tpm = Tpm::new();
+    let define = Command::new(TPM_ST_SESSIONS, TPM_CC_NV_DEFINE_SPACE)
+        .u32(TPM_RH_OWNER)
+        .pw_auth()
+        .tpm2b(&[])
+        .sized(|c| {
+            c.u32(NV_INDEX)
+                .u16(TPM_ALG_SHA256)
+                .u32(NV_INDEX_ATTRIBUTES)
+                .tpm2b(&[])
+                .u16(NV_INDEX_SIZE);
+        })
+        .finish();
+    let undefine = Command::new(TPM_ST_SESSIONS, TPM_CC_NV_UNDEFINE_SPACE)
+        .u32(TPM_RH_OWNER)
+        .u32(NV_INDEX)
+        .pw_auth()
+        .finish();
+    let write = Command::new(TPM_ST_SESSIONS, TPM_CC_NV_WRITE)
+        .u32(NV_INDEX)
+        .u32(NV_INDEX)
+        .pw_auth()
+        .tpm2b(&[0xc3; NV_INDEX_SIZE as usize])
+        .u16(0)
+        .finish();
+    let read = Command::new(TPM_ST_SESSIONS, TPM_CC_NV_READ)
+        .u32(NV_INDEX)
+        .u32(NV_INDEX)
+        .pw_auth()
+        .u16(NV_INDEX_SIZE)
+        .u16(0)
+        .finish();
+
+    b.bench("nv/define_undefine", DEFAULT_SAMPLES, || {
+        tpm.run(&define);
+        tpm.run(&undefine);
+    });
+    tpm.run(&define);
+    b.bench("nv/write_256", DEFAULT_SAMPLES, || {
+        black_box(tpm.run(&write).len());
+    });
+    b.bench("nv/read_256", DEFAULT_SAMPLES, || {
+        black_box(tpm.run(&read).len());
+    });
+}
+
+fn bench_save_restore(b: &Bencher) {
+    let mut tpm = Tpm::new();
+    let state = tpm.platform.save_state();
+
+    b.bench("state/save_state", DEFAULT_SAMPLES, || {
+        black_box(tpm.platform.save_state());
+    });
+    let mut buf = Vec::new();
+    b.bench("state/save_state_into", DEFAULT_SAMPLES, || {
+        buf.clear();
+        tpm.platform.save_state_into(&mut buf);
+        black_box(buf.len());
+    });
+    b.bench_batched(
+        "state/restore_state",
+        DEFAULT_SAMPLES,
+        || state.clone(),
+        |state| tpm.platform.restore_state(state).unwrap(),
+    );
+}
+
+fn main() {
+    let b = Bencher::from_args();
+    bench_startup(&b);
+    bench_get_random(&b);
+    bench_pcr_extend(&b);
+    bench_create_primary(&b);
+    bench_sign_verify(&b);
+    bench_hmac_session(&b);
+    bench_nv(&b);
+    bench_save_restore(&b);
+}
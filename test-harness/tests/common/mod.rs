@@ -0,0 +1,497 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! Helpers shared between the integration tests and benchmarks: an in-memory
+//! platform, a minimal TPM command marshaller, and just enough of the TPM 2.0
+//! session protocol to drive HMAC sessions.
+
+// not every helper is used by every test / bench target
+#![allow(dead_code)]
+
+use ms_tpm_20_ref::DynResult;
+use ms_tpm_20_ref::Error;
+use ms_tpm_20_ref::InitKind;
+use ms_tpm_20_ref::MsTpm20RefPlatform;
+use ms_tpm_20_ref::PlatformCallbacks;
+use ms_tpm_20_ref::ResourceManager;
+use std::convert::TryInto;
+use std::hint::black_box;
+use std::time::Instant;
+
+pub const TPM_ST_NO_SESSIONS: u16 = 0x8001;
+pub const TPM_ST_SESSIONS: u16 = 0x8002;
+pub const TPM_ST_HASHCHECK: u16 = 0x8024;
+
+pub const TPM_CC_NV_UNDEFINE_SPACE: u32 = 0x122;
+pub const TPM_CC_NV_DEFINE_SPACE: u32 = 0x12a;
+pub const TPM_CC_CREATE_PRIMARY: u32 = 0x131;
+pub const TPM_CC_NV_WRITE: u32 = 0x137;
+pub const TPM_CC_STARTUP: u32 = 0x144;
+pub const TPM_CC_NV_READ: u32 = 0x14e;
+pub const TPM_CC_SIGN: u32 = 0x15d;
+pub const TPM_CC_FLUSH_CONTEXT: u32 = 0x165;
+pub const TPM_CC_READ_PUBLIC: u32 = 0x173;
+pub const TPM_CC_START_AUTH_SESSION: u32 = 0x176;
+pub const TPM_CC_VERIFY_SIGNATURE: u32 = 0x177;
+pub const TPM_CC_GET_RANDOM: u32 = 0x17b;
+pub const TPM_CC_PCR_EXTEND: u32 = 0x182;
+
+pub const TPM_RH_OWNER: u32 = 0x4000_0001;
+pub const TPM_RH_NULL: u32 = 0x4000_0007;
+pub const TPM_RS_PW: u32 = 0x4000_0009;
+
+pub const TPM_ALG_RSA: u16 = 0x0001;
+pub const TPM_ALG_XOR: u16 = 0x000a;
+pub const TPM_ALG_SHA256: u16 = 0x000b;
+pub const TPM_ALG_NULL: u16 = 0x0010;
+pub const TPM_ALG_ECDSA: u16 = 0x0018;
+pub const TPM_ALG_ECC: u16 = 0x0023;
+pub const TPM_ECC_NIST_P256: u16 = 0x0003;
+
+pub const TPM_SE_HMAC: u8 = 0x00;
+
+// TPMA_SESSION
+pub const CONTINUE_SESSION: u8 = 0x01;
+pub const DECRYPT: u8 = 0x20;
+
+// fixedTPM | fixedParent | sensitiveDataOrigin | userWithAuth | sign
+pub const SIGNING_KEY_ATTRIBUTES: u32 = 0x0004_0072;
+
+/// In-memory platform with deterministic entropy.
+pub struct InMemoryPlatformCallbacks {
+    time: Instant,
+    rng: u64,
+}
+
+impl InMemoryPlatformCallbacks {
+    pub fn new() -> InMemoryPlatformCallbacks {
+        InMemoryPlatformCallbacks {
+            time: Instant::now(),
+            rng: 0x2545_f491_4f6c_dd1d,
+        }
+    }
+}
+
+impl PlatformCallbacks for InMemoryPlatformCallbacks {
+    fn commit_nv_state(&mut self, state: &[u8]) -> DynResult<()> {
+        black_box(state);
+        Ok(())
+    }
+
+    fn get_crypt_random(&mut self, buf: &mut [u8]) -> DynResult<usize> {
+        // xorshift64
+        for b in buf.iter_mut() {
+            self.rng ^= self.rng << 13;
+            self.rng ^= self.rng >> 7;
+            self.rng ^= self.rng << 17;
+            *b = self.rng as u8;
+        }
+        Ok(buf.len())
+    }
+
+    fn monotonic_timer(&mut self) -> std::time::Duration {
+        self.time.elapsed()
+    }
+
+    fn get_unique_value(&self) -> &'static [u8] {
+        b"ms-tpm-20-ref test platform"
+    }
+}
+
+/// Cold-init a fresh in-memory TPM instance.
+pub fn initialize() -> MsTpm20RefPlatform {
+    MsTpm20RefPlatform::initialize(
+        Box::new(InMemoryPlatformCallbacks::new()),
+        InitKind::ColdInit,
+    )
+    .expect("failed to initialize TPM")
+}
+
+/// Minimal TPM command marshaller.
+pub struct Command(Vec<u8>);
+
+impl Command {
+    pub fn new(tag: u16, command_code: u32) -> Command {
+        let mut cmd = Command(Vec::new());
+        cmd.u16(tag).u32(0).u32(command_code);
+        cmd
+    }
+
+    /// Start marshalling a bare parameter area (without a command header).
+    pub fn params() -> Command {
+        Command(Vec::new())
+    }
+
+    pub fn u8(&mut self, v: u8) -> &mut Self {
+        self.0.push(v);
+        self
+    }
+
+    pub fn u16(&mut self, v: u16) -> &mut Self {
+        self.0.extend_from_slice(&v.to_be_bytes());
+        self
+    }
+
+    pub fn u32(&mut self, v: u32) -> &mut Self {
+        self.0.extend_from_slice(&v.to_be_bytes());
+        self
+    }
+
+    pub fn bytes(&mut self, v: &[u8]) -> &mut Self {
+        self.0.extend_from_slice(v);
+        self
+    }
+
+    /// Append a TPM2B with the given contents.
+    pub fn tpm2b(&mut self, v: &[u8]) -> &mut Self {
+        self.u16(v.len() as u16).bytes(v)
+    }
+
+    /// Append a TPM2B wrapping whatever `f` marshals.
+    pub fn sized(&mut self, f: impl FnOnce(&mut Command)) -> &mut Self {
+        let mut inner = Command(Vec::new());
+        f(&mut inner);
+        self.tpm2b(&inner.0)
+    }
+
+    /// Append an authorization area with a single empty password session.
+    pub fn pw_auth(&mut self) -> &mut Self {
+        self.u32(9).u32(TPM_RS_PW).tpm2b(&[]).u8(0).tpm2b(&[])
+    }
+
+    /// Return the marshalled bytes as-is (e.g: for a bare parameter area).
+    pub fn take(&mut self) -> Vec<u8> {
+        std::mem::take(&mut self.0)
+    }
+
+    pub fn finish(&mut self) -> Vec<u8> {
+        let mut cmd = std::mem::take(&mut self.0);
+        let size = cmd.len() as u32;
+        cmd[2..6].copy_from_slice(&size.to_be_bytes());
+        cmd
+    }
+}
+
+/// Anything commands can be executed against.
+pub trait Execute {
+    fn execute(&mut self, request: &mut [u8], response: &mut [u8]) -> Result<usize, Error>;
+}
+
+impl Execute for MsTpm20RefPlatform {
+    fn execute(&mut self, request: &mut [u8], response: &mut [u8]) -> Result<usize, Error> {
+        self.execute_command(request, response)
+    }
+}
+
+impl Execute for ResourceManager {
+    fn execute(&mut self, request: &mut [u8], response: &mut [u8]) -> Result<usize, Error> {
+        self.execute_command(request, response)
+    }
+}
+
+pub fn response_code(res: &[u8]) -> u32 {
+    u32::from_be_bytes(res[6..10].try_into().unwrap())
+}
+
+pub struct Tpm<P = MsTpm20RefPlatform> {
+    pub platform: P,
+    request: Vec<u8>,
+    response: Vec<u8>,
+}
+
+impl Tpm {
+    /// Cold-init a fresh TPM, and send it TPM2_Startup.
+    pub fn new() -> Tpm {
+        Tpm::with_platform(initialize())
+    }
+}
+
+impl Tpm<ResourceManager> {
+    /// Cold-init a fresh TPM fronted by a [`ResourceManager`], and send it
+    /// TPM2_Startup.
+    pub fn with_resource_manager() -> Tpm<ResourceManager> {
+        Tpm::with_platform(ResourceManager::new(initialize()))
+    }
+}
+
+impl<P: Execute> Tpm<P> {
+    fn with_platform(platform: P) -> Tpm<P> {
+        let mut tpm = Tpm {
+            platform,
+            request: Vec::new(),
+            response: vec![0; 4096],
+        };
+        tpm.run(
+            &Command::new(TPM_ST_NO_SESSIONS, TPM_CC_STARTUP)
+                .u16(0)
+                .finish(),
+        );
+        tpm
+    }
+
+    /// Execute a command, returning the response whatever its response code.
+    pub fn try_run(&mut self, command: &[u8]) -> &[u8] {
+        self.request.clear();
+        self.request.extend_from_slice(command);
+        let len = self
+            .platform
+            .execute(&mut self.request, &mut self.response)
+            .expect("failed to execute command");
+        &self.response[..len]
+    }
+
+    /// Execute a command, asserting that it succeeded, and returning the
+    /// response.
+    pub fn run(&mut self, command: &[u8]) -> &[u8] {
+        let res = self.try_run(command);
+        assert_eq!(response_code(res), 0, "command failed: {:02x?}", command);
+        res
+    }
+
+    /// Execute a command which returns a handle, returning said handle.
+    pub fn run_for_handle(&mut self, command: &[u8]) -> u32 {
+        let res = self.run(command);
+        u32::from_be_bytes(res[10..14].try_into().unwrap())
+    }
+
+    pub fn flush(&mut self, handle: u32) {
+        self.run(
+            &Command::new(TPM_ST_NO_SESSIONS, TPM_CC_FLUSH_CONTEXT)
+                .u32(handle)
+                .finish(),
+        );
+    }
+}
+
+/// TPM2_CreatePrimary in the owner hierarchy, with an empty password
+/// authorization.
+pub fn create_primary(public: impl FnOnce(&mut Command)) -> Vec<u8> {
+    Command::new(TPM_ST_SESSIONS, TPM_CC_CREATE_PRIMARY)
+        .u32(TPM_RH_OWNER)
+        .pw_auth()
+        .bytes(&create_primary_params(&[], public))
+        .finish()
+}
+
+/// Parameter area of TPM2_CreatePrimary, with the given key `user_auth`.
+pub fn create_primary_params(user_auth: &[u8], public: impl FnOnce(&mut Command)) -> Vec<u8> {
+    Command::params()
+        // inSensitive: empty data
+        .sized(|c| {
+            c.tpm2b(user_auth).tpm2b(&[]);
+        })
+        .sized(public)
+        // outsideInfo
+        .tpm2b(&[])
+        // creationPCR
+        .u32(0)
+        .take()
+}
+
+pub fn rsa2048_public(c: &mut Command) {
+    c.u16(TPM_ALG_RSA)
+        .u16(TPM_ALG_SHA256)
+        .u32(SIGNING_KEY_ATTRIBUTES)
+        .tpm2b(&[])
+        // symmetric, scheme, keyBits, exponent
+        .u16(TPM_ALG_NULL)
+        .u16(TPM_ALG_NULL)
+        .u16(2048)
+        .u32(0)
+        .tpm2b(&[]);
+}
+
+pub fn ecc_p256_public(c: &mut Command) {
+    c.u16(TPM_ALG_ECC)
+        .u16(TPM_ALG_SHA256)
+        .u32(SIGNING_KEY_ATTRIBUTES)
+        .tpm2b(&[])
+        // symmetric, scheme, curveID, kdf
+        .u16(TPM_ALG_NULL)
+        .u16(TPM_ALG_NULL)
+        .u16(TPM_ECC_NIST_P256)
+        .u16(TPM_ALG_NULL)
+        .tpm2b(&[])
+        .tpm2b(&[]);
+}
+
+pub fn sha256(data: &[&[u8]]) -> [u8; 32] {
+    let mut md = [0; 32];
+    // SAFETY: the context is freed before returning, and all buffers outlive
+    // the calls that use them.
+    unsafe {
+        let ctx = openssl_sys::EVP_MD_CTX_new();
+        assert!(!ctx.is_null());
+        assert_eq!(
+            openssl_sys::EVP_DigestInit_ex(ctx, openssl_sys::EVP_sha256(), std::ptr::null_mut()),
+            1
+        );
+        for d in data {
+            assert_eq!(
+                openssl_sys::EVP_DigestUpdate(ctx, d.as_ptr().cast(), d.len()),
+                1
+            );
+        }
+        assert_eq!(
+            openssl_sys::EVP_DigestFinal_ex(ctx, md.as_mut_ptr(), std::ptr::null_mut()),
+            1
+        );
+        openssl_sys::EVP_MD_CTX_free(ctx);
+    }
+    md
+}
+
+pub fn hmac_sha256(key: &[u8], data: &[&[u8]]) -> [u8; 32] {
+    let mut md = [0; 32];
+    // SAFETY: the context is freed before returning, and all buffers outlive
+    // the calls that use them.
+    unsafe {
+        let ctx = openssl_sys::HMAC_CTX_new();
+        assert!(!ctx.is_null());
+        assert_eq!(
+            openssl_sys::HMAC_Init_ex(
+                ctx,
+                key.as_ptr().cast(),
+                key.len() as i32,
+                openssl_sys::EVP_sha256(),
+                std::ptr::null_mut(),
+            ),
+            1
+        );
+        for d in data {
+            assert_eq!(openssl_sys::HMAC_Update(ctx, d.as_ptr(), d.len()), 1);
+        }
+        assert_eq!(
+            openssl_sys::HMAC_Final(ctx, md.as_mut_ptr(), std::ptr::null_mut()),
+            1
+        );
+        openssl_sys::HMAC_CTX_free(ctx);
+    }
+    md
+}
+
+/// KDFa (TPM 2.0 Part 1, 11.4.10.2) using SHA-256.
+pub fn kdfa_sha256(
+    key: &[u8],
+    label: &[u8],
+    context_u: &[u8],
+    context_v: &[u8],
+    len: usize,
+) -> Vec<u8> {
+    let bits = (len as u32 * 8).to_be_bytes();
+    let mut out = Vec::with_capacity(len + 32);
+    let mut counter = 1u32;
+    while out.len() < len {
+        out.extend_from_slice(&hmac_sha256(
+            key,
+            &[
+                &counter.to_be_bytes(),
+                label,
+                &[0],
+                context_u,
+                context_v,
+                &bits,
+            ],
+        ));
+        counter += 1;
+    }
+    out.truncate(len);
+    out
+}
+
+/// An unbound, unsalted HMAC session, authorizing entities with an empty
+/// authValue.
+///
+/// With neither a tpmKey nor a bind entity, the session key is empty, so both
+/// the HMAC and the XOR parameter encryption keys are empty as well.
+pub struct HmacSession {
+    pub handle: u32,
+    nonce_tpm: Vec<u8>,
+    nonce_caller: [u8; 16],
+}
+
+impl HmacSession {
+    /// Start a new SHA-256 HMAC session, using XOR parameter encryption.
+    pub fn start<P: Execute>(tpm: &mut Tpm<P>) -> HmacSession {
+        let nonce_caller = [0x11; 16];
+        let res = tpm.run(
+            &Command::new(TPM_ST_NO_SESSIONS, TPM_CC_START_AUTH_SESSION)
+                .u32(TPM_RH_NULL)
+                .u32(TPM_RH_NULL)
+                .tpm2b(&nonce_caller)
+                // encryptedSalt
+                .tpm2b(&[])
+                .u8(TPM_SE_HMAC)
+                // symmetric: XOR with SHA-256 (which has no mode)
+                .u16(TPM_ALG_XOR)
+                .u16(TPM_ALG_SHA256)
+                .u16(TPM_ALG_SHA256)
+                .finish(),
+        );
+
+        let handle = u32::from_be_bytes(res[10..14].try_into().unwrap());
+        let nonce_len = u16::from_be_bytes(res[14..16].try_into().unwrap()) as usize;
+        HmacSession {
+            handle,
+            nonce_tpm: res[16..16 + nonce_len].to_vec(),
+            nonce_caller,
+        }
+    }
+
+    /// XOR-obfuscate the contents of the first (TPM2B) parameter of the next
+    /// command, as done by the TPM for sessions with the `decrypt` attribute.
+    pub fn encrypt_parameter(&self, params: &mut [u8]) {
+        let len = u16::from_be_bytes(params[0..2].try_into().unwrap()) as usize;
+        let mask = kdfa_sha256(&[], b"XOR", &self.nonce_caller, &self.nonce_tpm, len);
+        for (b, m) in params[2..2 + len].iter_mut().zip(mask) {
+            *b ^= m;
+        }
+    }
+
+    /// Build an authorization area for the next command, authorizing the
+    /// entities with the given `names` (all of which must have an empty
+    /// authValue).
+    pub fn auth_area(
+        &self,
+        command_code: u32,
+        names: &[&[u8]],
+        params: &[u8],
+        attributes: u8,
+    ) -> Vec<u8> {
+        let code = command_code.to_be_bytes();
+        let mut cp_hash_data = vec![&code[..]];
+        cp_hash_data.extend_from_slice(names);
+        cp_hash_data.push(params);
+        let cp_hash = sha256(&cp_hash_data);
+
+        let hmac = hmac_sha256(
+            &[],
+            &[&cp_hash, &self.nonce_caller, &self.nonce_tpm, &[attributes]],
+        );
+
+        let session = Command::params()
+            .u32(self.handle)
+            .tpm2b(&self.nonce_caller)
+            .u8(attributes)
+            .tpm2b(&hmac)
+            .take();
+        Command::params()
+            .u32(session.len() as u32)
+            .bytes(&session)
+            .take()
+    }
+
+    /// Pick up the new nonceTPM from a successful response with `handles`
+    /// response handles, and roll nonceCaller for the next command.
+    pub fn update(&mut self, res: &[u8], handles: usize) {
+        let params_at = 10 + handles * 4;
+        let param_size =
+            u32::from_be_bytes(res[params_at..params_at + 4].try_into().unwrap()) as usize;
+        let auth_at = params_at + 4 + param_size;
+        let nonce_len = u16::from_be_bytes(res[auth_at..auth_at + 2].try_into().unwrap()) as usize;
+        self.nonce_tpm = res[auth_at + 2..auth_at + 2 + nonce_len].to_vec();
+
+        for b in self.nonce_caller.iter_mut() {
+            *b = b.wrapping_add(1);
+        }
+    }
+}
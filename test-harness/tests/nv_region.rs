@@ -0,0 +1,44 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! End-to-end tests of caller-provided NV regions.
+
+mod common;
+
+use common::*;
+use ms_tpm_20_ref::Error;
+use ms_tpm_20_ref::InitKind;
+use ms_tpm_20_ref::MsTpm20RefPlatform;
+
+// NV_MEMORY_SIZE, as per `build.rs`
+const NV_MEMORY_SIZE: usize = 0x8000;
+
+fn initialize_with_region(
+    region: &'static mut [u8],
+    manufacture: bool,
+) -> Result<MsTpm20RefPlatform, Error> {
+    MsTpm20RefPlatform::initialize(
+        Box::new(InMemoryPlatformCallbacks::new()),
+        InitKind::ColdInitWithNvRegion {
+            region,
+            manufacture,
+        },
+    )
+}
+
+#[test]
+fn region_must_match_nv_size() {
+    for manufacture in [true, false] {
+        for len in [NV_MEMORY_SIZE - 1, NV_MEMORY_SIZE + 1, 0] {
+            let region = vec![0; len].leak();
+            assert!(
+                matches!(
+                    initialize_with_region(region, manufacture),
+                    Err(Error::NvMem(_))
+                ),
+                "accepted a {} byte region (manufacture: {})",
+                len,
+                manufacture
+            );
+        }
+    }
+}
@@ -0,0 +1,73 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! End-to-end tests of `ResourceManager`.
+
+mod common;
+
+use common::*;
+use std::convert::TryInto;
+
+// MAX_LOADED_OBJECTS, as per `Implementation.h`
+const MAX_LOADED_OBJECTS: usize = 3;
+
+/// Commands which only run out of object slots in their action code have
+/// already had their session-encrypted parameters decrypted (in place) by the
+/// time they fail, so the retry must be made with the original request.
+#[test]
+fn retry_with_encrypted_parameters() {
+    let mut tpm = Tpm::with_resource_manager();
+
+    let objects = (0..MAX_LOADED_OBJECTS)
+        .map(|_| tpm.run_for_handle(&create_primary(ecc_p256_public)))
+        .collect::<Vec<_>>();
+
+    let mut session = HmacSession::start(&mut tpm);
+    let attributes = CONTINUE_SESSION | DECRYPT;
+
+    let mut params = create_primary_params(b"secret user auth", ecc_p256_public);
+    session.encrypt_parameter(&mut params);
+    let auth = session.auth_area(
+        TPM_CC_CREATE_PRIMARY,
+        &[&TPM_RH_OWNER.to_be_bytes()],
+        &params,
+        attributes,
+    );
+    let create_primary = Command::new(TPM_ST_SESSIONS, TPM_CC_CREATE_PRIMARY)
+        .u32(TPM_RH_OWNER)
+        .bytes(&auth)
+        .bytes(&params)
+        .finish();
+
+    // all object slots are taken, so this only succeeds if the resource
+    // manager evicts an object, and retries with the still-encrypted request
+    let res = tpm.run(&create_primary);
+    let object = u32::from_be_bytes(res[10..14].try_into().unwrap());
+    session.update(res, 1);
+    assert!(!objects.contains(&object));
+
+    // the session is still good for subsequent commands
+    let mut params = create_primary_params(b"another user auth", ecc_p256_public);
+    session.encrypt_parameter(&mut params);
+    let auth = session.auth_area(
+        TPM_CC_CREATE_PRIMARY,
+        &[&TPM_RH_OWNER.to_be_bytes()],
+        &params,
+        attributes,
+    );
+    tpm.run(
+        &Command::new(TPM_ST_SESSIONS, TPM_CC_CREATE_PRIMARY)
+            .u32(TPM_RH_OWNER)
+            .bytes(&auth)
+            .bytes(&params)
+            .finish(),
+    );
+
+    // and the evicted objects can still be used
+    for object in objects {
+        tpm.run(
+            &Command::new(TPM_ST_NO_SESSIONS, TPM_CC_READ_PUBLIC)
+                .u32(object)
+                .finish(),
+        );
+    }
+}
@@ -0,0 +1,151 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+//! End-to-end tests of the streaming saved state format.
+
+mod common;
+
+use common::*;
+use ms_tpm_20_ref::Error;
+
+// magic, version, fingerprint
+const PLATFORM_LEN_OFFSET: usize = 8 + 4 + 8;
+const END_OF_ENTRIES_LEN: usize = 4;
+
+// as per `state_stream.rs`
+const NV_REGION_ENTRY_ID: u32 = u32::MAX;
+const ENTRY_FLAG_SPARSE: u8 = 1 << 0;
+
+fn save_state_stream(tpm: &Tpm) -> Vec<u8> {
+    let mut stream = Vec::new();
+    tpm.platform.save_state_stream(&mut stream).unwrap();
+    stream
+}
+
+/// Insert an entry just ahead of the end of `stream`.
+fn with_entry(stream: &[u8], id: u32, flags: u8, len: u32, data: &[u8]) -> Vec<u8> {
+    let (entries, end) = stream.split_at(stream.len() - END_OF_ENTRIES_LEN);
+    let mut stream = entries.to_vec();
+    stream.extend_from_slice(&id.to_le_bytes());
+    stream.push(flags);
+    stream.extend_from_slice(&len.to_le_bytes());
+    stream.extend_from_slice(data);
+    stream.extend_from_slice(end);
+    stream
+}
+
+fn read_public(tpm: &mut Tpm, object: u32) -> u32 {
+    let res = tpm.try_run(
+        &Command::new(TPM_ST_NO_SESSIONS, TPM_CC_READ_PUBLIC)
+            .u32(object)
+            .finish(),
+    );
+    response_code(res)
+}
+
+/// A TPM with an object which is loaded in the returned stream, but has since
+/// been flushed, so that the tests can tell whether a restore took effect.
+fn flushed_since_saved() -> (Tpm, u32, Vec<u8>) {
+    let mut tpm = Tpm::new();
+    let object = tpm.run_for_handle(&create_primary(ecc_p256_public));
+    let stream = save_state_stream(&tpm);
+    tpm.flush(object);
+    assert_ne!(read_public(&mut tpm, object), 0);
+    (tpm, object, stream)
+}
+
+/// Restore `stream`, which is expected to be rejected without the TPM's state
+/// being touched.
+fn restore_rejected(tpm: &mut Tpm, object: u32, stream: &[u8]) -> Error {
+    let err = tpm
+        .platform
+        .restore_state_stream(stream)
+        .expect_err("restored an invalid stream");
+    assert_ne!(read_public(tpm, object), 0);
+    err
+}
+
+#[test]
+fn round_trip() {
+    let (mut tpm, object, stream) = flushed_since_saved();
+    tpm.platform.restore_state_stream(&stream[..]).unwrap();
+    assert_eq!(read_public(&mut tpm, object), 0);
+}
+
+#[test]
+fn truncated() {
+    let (mut tpm, object, stream) = flushed_since_saved();
+    let step = (stream.len() / 64).max(1);
+    for len in (0..stream.len()).step_by(step).chain([stream.len() - 1]) {
+        let err = restore_rejected(&mut tpm, object, &stream[..len]);
+        assert!(
+            matches!(err, Error::StateStreamIo(_) | Error::InvalidRestoreFormat),
+            "{} byte prefix: {:?}",
+            len,
+            err
+        );
+    }
+}
+
+#[test]
+fn unknown_entries_are_skipped() {
+    let (mut tpm, object, stream) = flushed_since_saved();
+    let stream = with_entry(&stream, 0x7fff_0000, 0, 3, b"new");
+    tpm.platform.restore_state_stream(&stream[..]).unwrap();
+    assert_eq!(read_public(&mut tpm, object), 0);
+}
+
+#[test]
+fn truncated_unknown_entry() {
+    let (mut tpm, object, stream) = flushed_since_saved();
+    let mut stream = with_entry(&stream, 0x7fff_0000, 0, 100, b"short");
+    stream.truncate(stream.len() - END_OF_ENTRIES_LEN);
+    let err = restore_rejected(&mut tpm, object, &stream);
+    assert!(matches!(err, Error::StateStreamIo(_)), "{:?}", err);
+}
+
+#[test]
+fn reserved_flags() {
+    let (mut tpm, object, stream) = flushed_since_saved();
+    let stream = with_entry(&stream, 0x7fff_0000, 1 << 1, 0, &[]);
+    let err = restore_rejected(&mut tpm, object, &stream);
+    assert!(matches!(err, Error::InvalidRestoreFormat), "{:?}", err);
+}
+
+#[test]
+fn oversized_entry() {
+    let (mut tpm, object, stream) = flushed_since_saved();
+    // rejected before the entry's data is allocated
+    let stream = with_entry(
+        &stream,
+        NV_REGION_ENTRY_ID,
+        ENTRY_FLAG_SPARSE,
+        u32::MAX,
+        &[],
+    );
+    let err = restore_rejected(&mut tpm, object, &stream);
+    assert!(matches!(err, Error::InvalidRestoreFormat), "{:?}", err);
+}
+
+#[test]
+fn nv_region_must_be_sparse() {
+    let (mut tpm, object, stream) = flushed_since_saved();
+    let stream = with_entry(&stream, NV_REGION_ENTRY_ID, 0, 0, &[]);
+    let err = restore_rejected(&mut tpm, object, &stream);
+    assert!(matches!(err, Error::InvalidRestoreFormat), "{:?}", err);
+}
+
+#[test]
+fn oversized_platform_state() {
+    let (mut tpm, object, mut stream) = flushed_since_saved();
+    stream[PLATFORM_LEN_OFFSET..][..4].copy_from_slice(&u32::MAX.to_le_bytes());
+    let err = restore_rejected(&mut tpm, object, &stream);
+    assert!(matches!(err, Error::InvalidRestoreSize), "{:?}", err);
+}
+
+#[test]
+fn bad_magic() {
+    let (mut tpm, object, mut stream) = flushed_since_saved();
+    stream[0] ^= 1;
+    let err = restore_rejected(&mut tpm, object, &stream);
+    assert!(matches!(err, Error::InvalidRestoreFormat), "{:?}", err);
+}